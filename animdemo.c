@@ -1,6 +1,7 @@
 #include "libdragon.h"
 #include "animsprite.h"
 #include "t3ddebug.h"
+#include "paddle_anims.h"
 
 #include <malloc.h>
 #include <math.h>
@@ -69,11 +70,23 @@ void render(int cur_frame)
     rdpq_set_mode_standard();
     rdpq_mode_filter(FILTER_BILINEAR);
     rdpq_mode_alphacompare(1);                // colorkey (draw pixel with alpha >= 1)
+	int num_colors;
+	uint16_t *palette = AnimSpriteGetPalette(anim_sprite, &num_colors);
+	if(palette) {
+		// Frames built with a shared palette do not carry their own
+		rdpq_tex_upload_tlut(palette, 0, num_colors);
+	}
 	sprite_t *sprite = AnimSpriteGetSprite(anim_sprite);
-	
-	rdpq_sprite_blit(sprite, 320, 240, NULL);
+	AnimSpriteRect rect;
+	AnimSpriteGetRect(anim_sprite, &rect);
+	rdpq_sprite_blit(sprite, 320+rect.x_ofs, 240+rect.y_ofs, &(rdpq_blitparms_t){
+		.s0 = rect.s, .t0 = rect.t, .width = rect.width, .height = rect.height
+	});
 	t3d_debug_print_start();
 	t3d_debug_printf(530, 36, "%.1f FPS\n", display_get_fps());
+	AnimSpritePrefetchStats prefetch;
+	AnimSpriteGetPrefetchStats(&prefetch);
+	t3d_debug_printf(450, 48, "Prefetch late %lu/%lu\n", prefetch.late, prefetch.used);
 
     rdpq_detach_show();
 }
@@ -98,31 +111,36 @@ int main()
 
 	t3d_debug_print_init();
 	
+	// Enough to keep every frame of the paddle resident once shown
+	AnimSpriteSetCacheBudget(32*1024);
 	anim_sprite = AnimSpriteLoad("rom:/paddle.aspr");
     int cur_frame = 0;
     while (1)
     {
         render(cur_frame);
+		// After rdpq_detach_show so stream buffers drawn this frame are only
+		// reused once the RDP is done with them
+		AnimSpritePoolNextFrame();
 		AnimSpriteUpdate(anim_sprite, 1);
         joypad_poll();
         joypad_buttons_t ckeys = joypad_get_buttons_pressed(JOYPAD_PORT_1);
 		
 		if(ckeys.c_up) {
-			AnimSpriteSetAnim(anim_sprite, "grow");
+			AnimSpriteSetAnimIndex(anim_sprite, PADDLE_ANIM_GROW);
 			AnimSpriteSetLoop(anim_sprite, true);
 		}
 		if(ckeys.c_down) {
-			AnimSpriteSetAnim(anim_sprite, "shrink");
+			AnimSpriteSetAnimIndex(anim_sprite, PADDLE_ANIM_SHRINK);
 			AnimSpriteSetLoop(anim_sprite, false);
 		}
 		if(ckeys.c_left) {
-			AnimSpriteSetAnim(anim_sprite, "idle_small");
+			AnimSpriteSetAnimIndex(anim_sprite, PADDLE_ANIM_IDLE_SMALL);
 		}
 		if(ckeys.c_right) {
-			AnimSpriteSetAnim(anim_sprite, "idle_big");
+			AnimSpriteSetAnimIndex(anim_sprite, PADDLE_ANIM_IDLE_BIG);
 		}
 		if(ckeys.start) {
-			AnimSpriteSetAnim(anim_sprite, "bounce");
+			AnimSpriteSetAnimIndex(anim_sprite, PADDLE_ANIM_BOUNCE);
 			AnimSpriteSetLoop(anim_sprite, true);
 		}
         cur_frame++;
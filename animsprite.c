@@ -1,69 +1,756 @@
 #include "libdragon.h"
 #include "animsprite.h"
 #include "asprformat.h"
+#include <math.h>
 
-#define PTR_DECODE(base, ptr) ((void*)(((uint8_t*)(base)) + (uint32_t)(ptr)))
+#define PTR_DECODE(base, ptr) ((void*)(((uint8_t*)(base)) + (uint32_t)(uintptr_t)(ptr)))
+// First three bytes of files compressed by mkasset ("DCA")
+#define ASSET_MAGIC 0x444341
 
-#define MAX_STREAM_BUFS 2
+// Playback time and speed. Building with ANIMSPRITE_FIXED_TIME keeps them in
+// 16.16 fixed point so updates through the *Fixed functions use no floats.
+#ifdef ANIMSPRITE_FIXED_TIME
+typedef uint32_t AnimTime;
+#define TIME_ONE 0x10000
+#define TIME_FROM_TICKS(ticks) ((AnimTime)(ticks) << 16)
+// Rounds to nearest so speeds like 0.3 do not fall behind the float build.
+// Callers assert that value is non-negative, as converting a negative float
+// to AnimTime is undefined.
+#define TIME_FROM_FLOAT(value) ((AnimTime)((value)*65536.0f+0.5f))
+#define TIME_TO_FLOAT(time) ((time)/65536.0f)
+#define TIME_FROM_FIXED(value) (value)
+#define TIME_TO_FIXED(time) (time)
+#define TIME_MUL(a, b) ((AnimTime)(((uint64_t)(a)*(b)) >> 16))
+// Saturates instead of wrapping for animations that are left playing past
+// their end
+#define TIME_ADD(a, b) ((a)+(b) < (a) ? UINT32_MAX : (a)+(b))
+// Brings a time past the end of a looping animation into (0, total]
+#define TIME_WRAP(time, total) ((((time)-1) % (total))+1)
+#else
+typedef float AnimTime;
+#define TIME_ONE 1.0f
+#define TIME_FROM_TICKS(ticks) ((float)(ticks))
+#define TIME_FROM_FLOAT(value) (value)
+#define TIME_TO_FLOAT(time) (time)
+#define TIME_FROM_FIXED(value) ((value)/65536.0f)
+#define TIME_TO_FIXED(time) ((uint32_t)((time)*65536.0f))
+#define TIME_MUL(a, b) ((a)*(b))
+#define TIME_ADD(a, b) ((a)+(b))
+#define TIME_WRAP(time, total) ((time)-((ceilf((time)/(total))-1.0f)*(total)))
+#endif
+
+// Buffer of the stream pool holding one sprite of a sheet
+typedef struct stream_slot {
+	sprite_t *buf; // NULL for unused entries
+	uint32_t capacity;
+	uint32_t size;
+	ASPRData *sheet; // Sheet and sprite held by the buffer, NULL if none
+	uint32_t sprite_idx;
+	uint32_t refs;
+	uint32_t release_frame; // Display frame the buffer was last released in
+	uint32_t last_use; // Release order for evicting the least recently used frame
+	bool loading; // Written by an asynchronous DMA
+} StreamSlot;
+
+typedef struct stream_pool {
+	StreamSlot *slots;
+	int num_slots;
+	uint32_t budget;
+	uint32_t cache_budget;
+	uint32_t frame;
+	volatile uint32_t rdp_frame; // Display frames before this one are no longer drawn by the RDP
+	bool track_frames; // Set once AnimSpritePoolNextFrame is first called
+	uint32_t clock;
+	AnimSpritePoolStats stats;
+} StreamPool;
+
+// Sprites of one animation of a chunked sheet once read from ROM
+typedef struct sheet_chunk {
+	uint8_t *buf; // NULL while not loaded
+	uint32_t refs; // Sprites and group instances showing the animation
+	uint32_t release_frame; // Display frame the chunk was last released in
+	bool preload; // Kept loaded by AnimSpritePreloadAnims
+} SheetChunk;
+
+// Sheet loaded once and shared by every sprite created from the same path
+typedef struct aspr_sheet {
+	char *path;
+	ASPRData *data;
+	uint32_t sprite_romofs; // ROM address of the .aspr.dat file in stream and chunked mode
+	SheetChunk *chunks; // One per animation of chunked sheets, NULL otherwise
+	uint8_t *comp_buf; // Staging buffer for compressed sprites, NULL if none
+	struct anim_sprite *comp_owner; // Sprite reading ahead into comp_buf, NULL if none
+	uint32_t refs;
+	struct aspr_sheet *next;
+} ASPRSheet;
 
 typedef struct anim_sprite {
+	ASPRSheet *sheet;
 	ASPRData *data;
 	int anim_idx;
 	int frame_idx;
-	float time;
-	sprite_t *stream_buf[MAX_STREAM_BUFS];
-	int buffer;
+	AnimTime time;
+	int slot; // Stream pool buffer of the shown frame, -1 if none
+	int stream_sprite_idx;
+	uint32_t *delta_buf;
 	uint32_t sprite_romofs;
+	int prefetch_anim; // Frame being read ahead, -1 if none
+	int prefetch_frame;
+	int prefetch_slot;
+	int chunk_anim; // Animation whose chunk the sprite holds, -1 if none
 	bool loop;
 	bool pause;
 	bool dirty;
-	float speed;
+	AnimTime speed;
 } AnimSprite;
 
+static AnimSpritePrefetchStats prefetch_stats;
+static AnimSpriteDecompressStats decompress_stats;
+static StreamPool stream_pool = { .frame = 1, .rdp_frame = 1 };
+static ASPRSheet *sheet_list;
+
+// asset_load decompresses with the CPU, which leaves the loaded data dirty in
+// the cache. Uncompressed files are read straight to memory by DMA.
+static bool IsCompressedAsset(const char *path)
+{
+	if(strncmp(path, "rom:/", 5)) {
+		return true;
+	}
+	uint32_t romofs = dfs_rom_addr(path+5);
+	return romofs == 0 || (io_read(romofs) >> 8) == ASSET_MAGIC;
+}
+
 static ASPRData *LoadASPR(const char *path)
 {
 	int sz;
     ASPRData *data = asset_load(path, &sz);
-	
-	for(uint32_t i=0; i<data->anim_count; i++) {
-		data->anims[i] = PTR_DECODE(data, data->anims[i]);
+	assertf(data->magic == ASPR_MAGIC, "%s is not an animated sprite", path);
+	assertf(data->version == ASPR_VERSION, "%s has version %d, expected %d. Rebuild it with mkanimspr.", path, (int)data->version, ASPR_VERSION);
+	// Pointers are stored as offsets from the start of the file
+	uint32_t *relocs = PTR_DECODE(data, data->reloc_ofs);
+	for(uint32_t i=0; i<data->reloc_count; i++) {
+		void **ptr = PTR_DECODE(data, relocs[i]);
+		*ptr = PTR_DECODE(data, *ptr);
 	}
-	for(uint32_t i=0; i<data->anim_count; i++) {
-		data->anims[i]->name = PTR_DECODE(data, data->anims[i]->name);
+	// Relocated pointers are only read by the CPU. The palette and sprites
+	// used by the RDP only have to be written back if they were decompressed.
+	if(IsCompressedAsset(path)) {
+		data_cache_hit_writeback(PTR_DECODE(data, data->rdp_data_ofs), sz-data->rdp_data_ofs);
 	}
-	if(data->sprite_data) {
-		data->sprite_data = PTR_DECODE(data, data->sprite_data);
-		for(uint32_t i=0; i<data->sprite_count+1; i++) {
-			data->sprite_data->sprite[i] = PTR_DECODE(data, data->sprite_data->sprite[i]);
+	return data;
+}
+
+static void PoolFreeSlot(StreamSlot *slot)
+{
+	if(slot->sheet) {
+		stream_pool.stats.evictions++;
+	}
+	stream_pool.stats.bytes -= slot->capacity;
+	stream_pool.stats.num_buffers--;
+	free_uncached(slot->buf);
+	slot->buf = NULL;
+	slot->capacity = 0;
+	slot->sheet = NULL;
+}
+
+// Memory released in a display frame the RDP has finished drawing is no
+// longer read by it. Games that never call AnimSpritePoolNextFrame get it back
+// right away.
+static bool ReleasedBeforeFrame(uint32_t release_frame)
+{
+	return !stream_pool.track_frames || release_frame < stream_pool.rdp_frame;
+}
+
+static bool PoolSlotIdle(StreamSlot *slot)
+{
+	return slot->buf && slot->refs == 0 && ReleasedBeforeFrame(slot->release_frame);
+}
+
+// Returns the least recently released idle buffer of at least min_capacity
+// bytes, or -1 if there is none
+static int PoolFindIdle(uint32_t min_capacity)
+{
+	int found = -1;
+	for(int i=0; i<stream_pool.num_slots; i++) {
+		StreamSlot *slot = &stream_pool.slots[i];
+		if(PoolSlotIdle(slot) && slot->capacity >= min_capacity
+			&& (found == -1 || slot->last_use < stream_pool.slots[found].last_use)) {
+			found = i;
 		}
 	}
-	data_cache_hit_writeback_invalidate(data, sz);
-	return data;
+	return found;
+}
+
+// Frees idle buffers until size more bytes fit in the budget
+static bool PoolMakeRoom(uint32_t size)
+{
+	while(stream_pool.budget != 0 && stream_pool.stats.bytes+size > stream_pool.budget) {
+		int idle = PoolFindIdle(0);
+		if(idle == -1) {
+			return false;
+		}
+		PoolFreeSlot(&stream_pool.slots[idle]);
+	}
+	return true;
+}
+
+static int PoolAllocSlot(uint32_t capacity)
+{
+	int index;
+	for(index=0; index<stream_pool.num_slots; index++) {
+		if(!stream_pool.slots[index].buf) {
+			break;
+		}
+	}
+	if(index == stream_pool.num_slots) {
+		stream_pool.num_slots++;
+		stream_pool.slots = realloc(stream_pool.slots, stream_pool.num_slots*sizeof(StreamSlot));
+	}
+	StreamSlot *slot = &stream_pool.slots[index];
+	memset(slot, 0, sizeof(StreamSlot));
+	slot->buf = malloc_uncached(capacity);
+	slot->capacity = capacity;
+	stream_pool.stats.bytes += capacity;
+	stream_pool.stats.num_buffers++;
+	if(stream_pool.stats.bytes > stream_pool.stats.peak_bytes) {
+		stream_pool.stats.peak_bytes = stream_pool.stats.bytes;
+	}
+	return index;
+}
+
+// Returns the size of the buffers that no sprite holds
+static uint32_t PoolUnusedBytes(void)
+{
+	uint32_t bytes = 0;
+	for(int i=0; i<stream_pool.num_slots; i++) {
+		if(stream_pool.slots[i].buf && stream_pool.slots[i].refs == 0) {
+			bytes += stream_pool.slots[i].capacity;
+		}
+	}
+	return bytes;
+}
+
+// Borrows a buffer for a sprite of a sheet. If another sprite holds it or it
+// is still cached, loaded is set and the buffer is reused as is. Otherwise the
+// caller must fill it. Optional requests return -1 instead of going over the
+// budget.
+static int PoolAcquire(ASPRData *sheet, uint32_t sprite_idx, uint32_t size, bool optional, bool *loaded)
+{
+	for(int i=0; i<stream_pool.num_slots; i++) {
+		StreamSlot *slot = &stream_pool.slots[i];
+		if(slot->buf && slot->sheet == sheet && slot->sprite_idx == sprite_idx) {
+			if(slot->loading) {
+				dma_wait();
+				slot->loading = false;
+			}
+			if(slot->refs != 0) {
+				stream_pool.stats.shared++;
+			} else {
+				stream_pool.stats.hits++;
+			}
+			slot->refs++;
+			*loaded = true;
+			return i;
+		}
+	}
+	uint32_t capacity = sheet->stream_data->spr_max_size;
+	int index = -1;
+	if(PoolUnusedBytes()+capacity > stream_pool.cache_budget) {
+		// Keeping another frame would exceed the cache budget
+		index = PoolFindIdle(size);
+		if(index != -1 && stream_pool.slots[index].sheet) {
+			stream_pool.stats.evictions++;
+		}
+	}
+	if(index == -1) {
+		if(!PoolMakeRoom(capacity)) {
+			if(optional) {
+				return -1;
+			}
+			stream_pool.stats.over_budget++;
+		}
+		index = PoolAllocSlot(capacity);
+	}
+	StreamSlot *slot = &stream_pool.slots[index];
+	slot->sheet = sheet;
+	slot->sprite_idx = sprite_idx;
+	slot->size = size;
+	slot->refs = 1;
+	slot->loading = false;
+	stream_pool.stats.misses++;
+	*loaded = false;
+	return index;
+}
+
+static void PoolRelease(int index)
+{
+	if(index == -1) {
+		return;
+	}
+	StreamSlot *slot = &stream_pool.slots[index];
+	slot->refs--;
+	slot->release_frame = stream_pool.frame;
+	slot->last_use = stream_pool.clock++;
+}
+
+// Forgets the sprites of a sheet that is freed
+static void PoolForgetSheet(ASPRData *sheet)
+{
+	for(int i=0; i<stream_pool.num_slots; i++) {
+		if(stream_pool.slots[i].sheet == sheet) {
+			stream_pool.slots[i].sheet = NULL;
+		}
+	}
+}
+
+static void LoadChunk(ASPRSheet *sheet, int anim_idx)
+{
+	SheetChunk *chunk = &sheet->chunks[anim_idx];
+	if(chunk->buf) {
+		return;
+	}
+	ASPRChunk *info = &sheet->data->chunks[anim_idx];
+	chunk->buf = memalign(16, (info->size+15) & ~15);
+	data_cache_hit_writeback_invalidate(chunk->buf, info->size);
+	dma_read(chunk->buf, sheet->sprite_romofs+info->ofs, info->size);
+}
+
+// Chunks stay loaded once released until they are evicted
+static void AcquireChunk(ASPRSheet *sheet, int anim_idx)
+{
+	if(!sheet->chunks) {
+		return;
+	}
+	LoadChunk(sheet, anim_idx);
+	sheet->chunks[anim_idx].refs++;
+}
+
+static void ReleaseChunk(ASPRSheet *sheet, int anim_idx)
+{
+	if(!sheet->chunks || anim_idx == -1) {
+		return;
+	}
+	sheet->chunks[anim_idx].refs--;
+	sheet->chunks[anim_idx].release_frame = stream_pool.frame;
+}
+
+// Frees a chunk unless it is shown, preloaded or may still be drawn by the
+// RDP
+static void EvictChunk(SheetChunk *chunk)
+{
+	if(chunk->buf && chunk->refs == 0 && !chunk->preload && ReleasedBeforeFrame(chunk->release_frame)) {
+		free(chunk->buf);
+		chunk->buf = NULL;
+	}
 }
 
-static uint32_t GetImageIdx(AnimSprite *sprite)
+static sprite_t *GetChunkSprite(ASPRSheet *sheet, int anim_idx, int frame_idx)
+{
+	return (sprite_t *)(sheet->chunks[anim_idx].buf+sheet->data->chunks[anim_idx].frame_ofs[frame_idx]);
+}
+
+static ASPRImage *GetImage(AnimSprite *sprite)
+{
+	ASPRAnim *anim = sprite->data->anims[sprite->anim_idx];
+	return &sprite->data->images[anim->frames[sprite->frame_idx].sprite_idx];
+}
+
+static uint32_t GetSpriteIdx(AnimSprite *sprite)
+{
+	return GetImage(sprite)->sprite_idx;
+}
+
+static uint32_t GetFrameSpriteIdx(AnimSprite *sprite, int frame_idx)
 {
 	ASPRAnim *anim = sprite->data->anims[sprite->anim_idx];
-	return anim->frames[sprite->frame_idx].sprite_idx;
+	return sprite->data->images[anim->frames[frame_idx].sprite_idx].sprite_idx;
+}
+
+// Returns the size of a streamed sprite once it is decompressed
+static uint32_t GetRawSize(ASPRData *data, uint32_t image)
+{
+	ASPRStreamData *stream_data = data->stream_data;
+	if(stream_data->raw_size) {
+		return stream_data->raw_size[image];
+	}
+	return stream_data->sprite_ofs[image+1]-stream_data->sprite_ofs[image];
+}
+
+static bool IsCompressed(ASPRData *data, uint32_t image)
+{
+	ASPRStreamData *stream_data = data->stream_data;
+	if(!stream_data->raw_size) {
+		return false;
+	}
+	// Both sizes include the padding of sprites to 8 bytes
+	uint32_t size = stream_data->sprite_ofs[image+1]-stream_data->sprite_ofs[image];
+	return size < ((stream_data->raw_size[image]+7) & ~7);
+}
+
+// Compressed sprites are read into the start of the staging buffer and
+// decompressed into cached memory after it, then copied to the stream buffer
+static uint8_t *AllocCompBuf(ASPRData *data)
+{
+	if(!data->stream_data || data->stream_data->comp_max_size == 0) {
+		return NULL;
+	}
+	return memalign(16, ((data->stream_data->comp_max_size+15) & ~15)+data->stream_data->spr_max_size);
+}
+
+// Decompresses an LZ4 block until dst_size bytes are written. The padding
+// after the block is never read.
+static void DecompressLZ4(const uint8_t *src, uint8_t *dst, uint32_t dst_size)
+{
+	uint8_t *dst_end = dst+dst_size;
+	while(dst < dst_end) {
+		uint8_t token = *src++;
+		uint32_t len = token >> 4;
+		if(len == 15) {
+			uint8_t byte;
+			do {
+				byte = *src++;
+				len += byte;
+			} while(byte == 255);
+		}
+		memcpy(dst, src, len);
+		dst += len;
+		src += len;
+		if(dst >= dst_end) {
+			break;
+		}
+		uint32_t offset = src[0] | (src[1] << 8);
+		src += 2;
+		len = (token & 15)+4;
+		if((token & 15) == 15) {
+			uint8_t byte;
+			do {
+				byte = *src++;
+				len += byte;
+			} while(byte == 255);
+		}
+		// Matches can overlap the bytes they produce
+		const uint8_t *match = dst-offset;
+		while(len--) {
+			*dst++ = *match++;
+		}
+	}
+}
+
+static void DecompressStreamSprite(ASPRData *data, uint8_t *comp_buf, sprite_t *buf, uint32_t image)
+{
+	uint32_t start = TICKS_READ();
+	uint32_t raw_size = GetRawSize(data, image);
+	uint8_t *out = comp_buf+((data->stream_data->comp_max_size+15) & ~15);
+	DecompressLZ4(comp_buf, out, raw_size);
+	memcpy(buf, out, raw_size);
+	decompress_stats.frames++;
+	decompress_stats.bytes_read += data->stream_data->sprite_ofs[image+1]-data->stream_data->sprite_ofs[image];
+	decompress_stats.bytes_written += raw_size;
+	decompress_stats.ticks += TICKS_DISTANCE(start, TICKS_READ());
+}
+
+// Starts reading a sprite into buf, or into comp_buf if it is compressed
+static void ReadStreamSprite(ASPRData *data, uint32_t romofs, uint8_t *comp_buf, sprite_t *buf, uint32_t image, bool async)
+{
+	uint32_t *sprite_ofs = data->stream_data->sprite_ofs;
+	uint32_t size = sprite_ofs[image+1]-sprite_ofs[image];
+	void *dst = buf;
+	if(IsCompressed(data, image)) {
+		data_cache_hit_writeback_invalidate(comp_buf, size);
+		dst = comp_buf;
+	}
+	if(async) {
+		dma_read_async(dst, romofs+sprite_ofs[image], size);
+	} else {
+		dma_read(dst, romofs+sprite_ofs[image], size);
+	}
+}
+
+// Takes the staging buffer of a sheet for a load that is waited for. A
+// compressed frame another sprite is reading ahead into it is dropped.
+static uint8_t *TakeCompBuf(ASPRSheet *sheet)
+{
+	AnimSprite *owner = sheet->comp_owner;
+	if(owner) {
+		dma_wait();
+		owner->prefetch_anim = -1;
+		sheet->comp_owner = NULL;
+		prefetch_stats.wasted++;
+	}
+	return sheet->comp_buf;
+}
+
+static void LoadSheetSprite(ASPRSheet *sheet, sprite_t *buf, uint32_t image)
+{
+	if(IsCompressed(sheet->data, image)) {
+		uint8_t *comp_buf = TakeCompBuf(sheet);
+		ReadStreamSprite(sheet->data, sheet->sprite_romofs, comp_buf, buf, image, false);
+		DecompressStreamSprite(sheet->data, comp_buf, buf, image);
+	} else {
+		ReadStreamSprite(sheet->data, sheet->sprite_romofs, NULL, buf, image, false);
+	}
+}
+
+static void LoadStreamSprite(AnimSprite *sprite, sprite_t *buf, uint32_t image)
+{
+	LoadSheetSprite(sprite->sheet, buf, image);
+}
+
+static void ReadDelta(AnimSprite *sprite, ASPRDelta *delta, bool async)
+{
+	data_cache_hit_writeback_invalidate(sprite->delta_buf, (delta->size+15) & ~15);
+	if(async) {
+		dma_read_async(sprite->delta_buf, sprite->sprite_romofs+delta->ofs, delta->size);
+	} else {
+		dma_read(sprite->delta_buf, sprite->sprite_romofs+delta->ofs, delta->size);
+	}
+}
+
+static void PatchDelta(AnimSprite *sprite, sprite_t *buf)
+{
+	uint32_t *record = sprite->delta_buf;
+	uint32_t num_spans = *record++;
+	for(uint32_t i=0; i<num_spans; i++) {
+		uint32_t ofs = record[0];
+		uint32_t size = record[1];
+		memcpy(((uint8_t *)buf)+ofs, &record[2], size);
+		record += 2+((size+3)/4);
+	}
+}
+
+static void ApplyDelta(AnimSprite *sprite, sprite_t *buf, ASPRDelta *delta)
+{
+	ReadDelta(sprite, delta, false);
+	PatchDelta(sprite, buf);
+}
+
+static ASPRDelta *GetDeltas(AnimSprite *sprite)
+{
+	if(!sprite->data->anim_deltas) {
+		return NULL;
+	}
+	return sprite->data->anim_deltas[sprite->anim_idx];
+}
+
+static int AcquireStreamSlot(AnimSprite *sprite, uint32_t image, bool optional, bool *loaded)
+{
+	return PoolAcquire(sprite->data, image, GetRawSize(sprite->data, image), optional, loaded);
+}
+
+// Fills a stream buffer with the shown frame from the frame before it, whose
+// sprite is held by the sprite
+static void PatchShownFrame(AnimSprite *sprite, int slot)
+{
+	StreamSlot *prev = &stream_pool.slots[sprite->slot];
+	memcpy(stream_pool.slots[slot].buf, prev->buf, prev->size);
+	PatchDelta(sprite, stream_pool.slots[slot].buf);
+}
+
+// Finishes reading ahead. Returns the buffer holding the frame that is
+// needed now, or -1 if a different frame was read.
+static int FinishPrefetch(AnimSprite *sprite)
+{
+	if(sprite->prefetch_anim == -1) {
+		return -1;
+	}
+	bool hit = sprite->prefetch_anim == sprite->anim_idx && sprite->prefetch_frame == sprite->frame_idx;
+	int slot = sprite->prefetch_slot;
+	sprite->prefetch_anim = -1;
+	sprite->prefetch_slot = -1;
+	if(dma_busy()) {
+		if(hit) {
+			prefetch_stats.late++;
+		}
+		dma_wait();
+	}
+	if(slot != -1) {
+		stream_pool.slots[slot].loading = false;
+	}
+	// A compressed frame is decompressed below, before any other sprite can
+	// take the staging buffer
+	if(sprite->sheet->comp_owner == sprite) {
+		sprite->sheet->comp_owner = NULL;
+	}
+	if(!hit) {
+		prefetch_stats.wasted++;
+		PoolRelease(slot);
+		return -1;
+	}
+	prefetch_stats.used++;
+	if(slot == -1) {
+		// A delta record or compressed sprite was read
+		bool loaded;
+		uint32_t image = GetSpriteIdx(sprite);
+		slot = AcquireStreamSlot(sprite, image, false, &loaded);
+		if(!loaded) {
+			ASPRDelta *deltas = GetDeltas(sprite);
+			if(deltas && deltas[sprite->frame_idx].ofs != 0) {
+				PatchShownFrame(sprite, slot);
+			} else {
+				DecompressStreamSprite(sprite->data, sprite->sheet->comp_buf, stream_pool.slots[slot].buf, image);
+			}
+		}
+	}
+	return slot;
 }
 
 static void UpdateSpriteFrame(AnimSprite *sprite)
 {
-	if(sprite->data->sprite_data) {
+	if(sprite->data->chunks) {
+		if(sprite->chunk_anim != sprite->anim_idx) {
+			AcquireChunk(sprite->sheet, sprite->anim_idx);
+			ReleaseChunk(sprite->sheet, sprite->chunk_anim);
+			sprite->chunk_anim = sprite->anim_idx;
+		}
 		return;
 	}
-	uint32_t base_ofs = sprite->sprite_romofs;
-	uint32_t ofs = base_ofs+offsetof(ASPRSpriteData, sprite);
-	uint32_t image_ofs[2];
-	uint32_t image = GetImageIdx(sprite);
-	ofs += sizeof(uint32_t)*image;
-	data_cache_hit_writeback_invalidate(&image_ofs, sizeof(image_ofs));
-    dma_read(&image_ofs, ofs, sizeof(image_ofs));
-	dma_read(sprite->stream_buf[sprite->buffer], base_ofs+image_ofs[0], image_ofs[1]-image_ofs[0]);
-	sprite->buffer++;
-	if(sprite->buffer >= MAX_STREAM_BUFS) {
-		sprite->buffer = 0;
+	if(!sprite->data->stream_data) {
+		return;
+	}
+	uint32_t image = GetSpriteIdx(sprite);
+	if(image == sprite->stream_sprite_idx) {
+		// Frames packed into the same atlas page share the loaded sprite
+		return;
+	}
+	int slot = FinishPrefetch(sprite);
+	if(slot == -1) {
+		bool loaded;
+		slot = AcquireStreamSlot(sprite, image, false, &loaded);
+		if(!loaded) {
+			sprite_t *buf = stream_pool.slots[slot].buf;
+			ASPRDelta *deltas = GetDeltas(sprite);
+			int frame = sprite->frame_idx;
+			if(deltas && deltas[frame].ofs != 0) {
+				if(sprite->stream_sprite_idx == GetFrameSpriteIdx(sprite, frame-1)) {
+					// Patch a copy of the previous frame
+					ReadDelta(sprite, &deltas[frame], false);
+					PatchShownFrame(sprite, slot);
+				} else {
+					// Rebuild from the closest keyframe before this frame
+					int keyframe = frame;
+					while(deltas[keyframe].ofs != 0) {
+						keyframe--;
+					}
+					LoadStreamSprite(sprite, buf, GetFrameSpriteIdx(sprite, keyframe));
+					for(int i=keyframe+1; i<=frame; i++) {
+						ApplyDelta(sprite, buf, &deltas[i]);
+					}
+				}
+			} else {
+				LoadStreamSprite(sprite, buf, image);
+			}
+		}
+	}
+	PoolRelease(sprite->slot);
+	sprite->slot = slot;
+	sprite->stream_sprite_idx = image;
+}
+
+// Starts reading the frame that follows the shown one into a spare stream
+// buffer. UpdateSpriteFrame waits for the read once that frame is needed.
+static void PrefetchNextFrame(AnimSprite *sprite)
+{
+	if(!sprite->data->stream_data || sprite->dirty || sprite->prefetch_anim != -1) {
+		return;
+	}
+	ASPRAnim *anim = sprite->data->anims[sprite->anim_idx];
+	int frame = sprite->frame_idx+1;
+	if(frame >= anim->num_frames) {
+		if(!sprite->loop) {
+			return;
+		}
+		frame = 0;
+	}
+	uint32_t image = GetFrameSpriteIdx(sprite, frame);
+	if(image == sprite->stream_sprite_idx || GetSpriteIdx(sprite) != sprite->stream_sprite_idx) {
+		return;
+	}
+	ASPRDelta *deltas = GetDeltas(sprite);
+	if(deltas && deltas[frame].ofs != 0) {
+		// The delta is applied to the shown frame, which precedes it
+		ReadDelta(sprite, &deltas[frame], true);
+		sprite->prefetch_slot = -1;
+	} else if(IsCompressed(sprite->data, image)) {
+		// Decompressed into a buffer once needed so no other sprite can see
+		// the buffer before it is complete. The staging buffer is shared by
+		// the sprites of the sheet.
+		if(sprite->sheet->comp_owner) {
+			return;
+		}
+		sprite->sheet->comp_owner = sprite;
+		ReadStreamSprite(sprite->data, sprite->sprite_romofs, sprite->sheet->comp_buf, NULL, image, true);
+		sprite->prefetch_slot = -1;
+	} else {
+		bool loaded;
+		int slot = AcquireStreamSlot(sprite, image, true, &loaded);
+		if(slot == -1) {
+			// No spare buffer within the pool budget
+			return;
+		}
+		if(!loaded) {
+			StreamSlot *dst = &stream_pool.slots[slot];
+			ReadStreamSprite(sprite->data, sprite->sprite_romofs, NULL, dst->buf, image, true);
+			dst->loading = true;
+		}
+		sprite->prefetch_slot = slot;
 	}
+	sprite->prefetch_anim = sprite->anim_idx;
+	sprite->prefetch_frame = frame;
+	prefetch_stats.issued++;
+}
+
+static ASPRSheet *AcquireSheet(const char *path)
+{
+	for(ASPRSheet *sheet = sheet_list; sheet; sheet = sheet->next) {
+		if(!strcmp(sheet->path, path)) {
+			sheet->refs++;
+			return sheet;
+		}
+	}
+	ASPRSheet *sheet = malloc(sizeof(ASPRSheet));
+	sheet->path = strdup(path);
+	sheet->data = LoadASPR(path);
+	sheet->sprite_romofs = 0;
+	sheet->chunks = NULL;
+	sheet->comp_buf = AllocCompBuf(sheet->data);
+	sheet->comp_owner = NULL;
+	sheet->refs = 1;
+	if(sheet->data->sprite_data == NULL) {
+		char path_buf[strlen(path)+5];
+		strcpy(path_buf, path);
+		strcat(path_buf, ".dat");
+		sheet->sprite_romofs = dfs_rom_addr(path_buf+5);
+		assertf(sheet->sprite_romofs != 0, "File %s missing", path_buf);
+	}
+	if(sheet->data->chunks) {
+		sheet->chunks = calloc(sheet->data->anim_count, sizeof(SheetChunk));
+	}
+	sheet->next = sheet_list;
+	sheet_list = sheet;
+	return sheet;
+}
+
+static void ReleaseSheet(ASPRSheet *sheet)
+{
+	if(--sheet->refs != 0) {
+		return;
+	}
+	ASPRSheet **link = &sheet_list;
+	while(*link != sheet) {
+		link = &(*link)->next;
+	}
+	*link = sheet->next;
+	PoolForgetSheet(sheet->data);
+	if(sheet->chunks) {
+		for(uint32_t i=0; i<sheet->data->anim_count; i++) {
+			free(sheet->chunks[i].buf);
+		}
+		free(sheet->chunks);
+	}
+	free(sheet->comp_buf);
+	free(sheet->data);
+	free(sheet->path);
+	free(sheet);
 }
 
 AnimSprite *AnimSpriteLoad(const char *path)
@@ -71,29 +758,27 @@ AnimSprite *AnimSpriteLoad(const char *path)
 	assertf(strncmp(path, "rom:/", 5) == 0, "Cannot open %s: File must be in ROM (rom:/)", path);
 	AnimSprite *sprite = malloc(sizeof(AnimSprite));
 	
-	sprite->data = LoadASPR(path);
+	sprite->sheet = AcquireSheet(path);
+	sprite->data = sprite->sheet->data;
 	sprite->anim_idx = 0;
 	sprite->frame_idx = 0;
 	sprite->time = 0;
-	sprite->sprite_romofs = 0;
+	sprite->sprite_romofs = sprite->sheet->sprite_romofs;
+	sprite->slot = -1;
+	sprite->prefetch_anim = -1;
+	sprite->prefetch_slot = -1;
+	sprite->chunk_anim = -1;
 	sprite->loop = false;
 	sprite->pause = false;
 	sprite->dirty = true;
-	sprite->speed = 1.0f;
+	sprite->speed = TIME_ONE;
 	
 	
-	if(sprite->data->sprite_data == NULL) {
-		char path_buf[strlen(path)+5];
-		strcpy(path_buf, path);
-		strcat(path_buf, ".dat");
-		sprite->sprite_romofs = dfs_rom_addr(path_buf+5);
-		assertf(sprite->sprite_romofs != 0, "File %s missing", path_buf);
-		sprite->buffer = 0;
-		uint32_t data_size;
-		data_cache_hit_writeback_invalidate(&data_size, sizeof(data_size));
-		dma_read(&data_size, sprite->sprite_romofs+offsetof(ASPRSpriteData, spr_max_size), sizeof(data_size));
-		for(size_t i=0; i<MAX_STREAM_BUFS; i++) {
-			sprite->stream_buf[i] = malloc_uncached(data_size);
+	if(sprite->data->stream_data) {
+		sprite->stream_sprite_idx = -1;
+		sprite->delta_buf = NULL;
+		if(sprite->data->anim_deltas) {
+			sprite->delta_buf = memalign(16, (sprite->data->delta_max_size+15) & ~15);
 		}
 	}
 	return sprite;
@@ -101,30 +786,65 @@ AnimSprite *AnimSpriteLoad(const char *path)
 
 void AnimSpriteDelete(AnimSprite *sprite)
 {
-	if(sprite->data->sprite_data) {
-		for(size_t i=0; i<MAX_STREAM_BUFS; i++) {
-			free_uncached(sprite->stream_buf[i]);
+	if(sprite->data->stream_data) {
+		if(sprite->prefetch_anim != -1) {
+			dma_wait();
+			if(sprite->prefetch_slot != -1) {
+				stream_pool.slots[sprite->prefetch_slot].loading = false;
+			}
+		}
+		if(sprite->sheet->comp_owner == sprite) {
+			sprite->sheet->comp_owner = NULL;
 		}
+		PoolRelease(sprite->prefetch_slot);
+		PoolRelease(sprite->slot);
+		free(sprite->delta_buf);
 	}
+	ReleaseChunk(sprite->sheet, sprite->chunk_anim);
 	
-	free(sprite->data);
+	ReleaseSheet(sprite->sheet);
 	free(sprite);
 }
 
+// FNV-1a hash of an animation name. Must match HashAnimName in mkanimspr.
+static uint32_t HashAnimName(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	while(*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 static int32_t SearchAnim(ASPRData *data, const char *name)
 {
-	for(uint32_t i=0; i<data->anim_count; i++) {
-		if(!strcmp(data->anims[i]->name, name)) {
-			return i;
+	uint32_t slot = HashAnimName(name) & data->anim_hash_mask;
+	while(data->anim_hash[slot] != 0xFFFF) {
+		uint16_t anim_idx = data->anim_hash[slot];
+		if(!strcmp(data->anims[anim_idx]->name, name)) {
+			return anim_idx;
 		}
+		slot = (slot+1) & data->anim_hash_mask;
 	}
 	return -1;
 }
 
+int AnimSpriteFindAnim(AnimSprite *sprite, const char *name)
+{
+	return SearchAnim(sprite->data, name);
+}
+
 void AnimSpriteSetAnim(AnimSprite *sprite, const char *name)
 {
 	int32_t anim_idx = SearchAnim(sprite->data, name);
 	assertf(anim_idx != -1, "No animation named %s exists.", name);
+	AnimSpriteSetAnimIndex(sprite, anim_idx);
+}
+
+void AnimSpriteSetAnimIndex(AnimSprite *sprite, int anim_idx)
+{
+	assertf(anim_idx >= 0 && anim_idx < (int)sprite->data->anim_count, "Animation index %d out of range.", anim_idx);
 	if(sprite->anim_idx != anim_idx) {
 		sprite->anim_idx = anim_idx;
 		sprite->time = 0;
@@ -138,62 +858,486 @@ void AnimSpriteSetLoop(AnimSprite *sprite, bool loop)
 	sprite->loop = loop;
 }
 
-void AnimSpriteSetTime(AnimSprite *sprite, float time)
+// Returns the frame shown at a time, the last one starting before it
+static int FindFrame(ASPRAnim *anim, AnimTime time)
 {
+	int low = 0;
+	int high = anim->num_frames-1;
+	while(low < high) {
+		int mid = (low+high+1)/2;
+		if(time > TIME_FROM_TICKS(anim->frames[mid].time)) {
+			low = mid;
+		} else {
+			high = mid-1;
+		}
+	}
+	return low;
+}
+
+static void SetTime(AnimSprite *sprite, AnimTime time)
+{
+	ASPRAnim *anim = sprite->data->anims[sprite->anim_idx];
+	AnimTime total_time = TIME_FROM_TICKS(anim->total_time);
+	if(sprite->loop && total_time != 0 && time > total_time) {
+		time = TIME_WRAP(time, total_time);
+	}
 	sprite->time = time;
-	sprite->frame_idx = 0;
+	int frame_idx = FindFrame(anim, time);
+	if(frame_idx != sprite->frame_idx) {
+		sprite->frame_idx = frame_idx;
+		sprite->dirty = true;
+	}
+}
+
+void AnimSpriteSetTime(AnimSprite *sprite, float time)
+{
+	assertf(time >= 0, "Time must be non-negative");
+	SetTime(sprite, TIME_FROM_FLOAT(time));
+}
+
+void AnimSpriteSetTimeFixed(AnimSprite *sprite, uint32_t time)
+{
+	SetTime(sprite, TIME_FROM_FIXED(time));
 }
 
 void AnimSpriteSetSpeed(AnimSprite *sprite, float speed)
 {
 	assertf(speed >= 0, "Speed must be non-negative");
-	sprite->speed = speed;
+	sprite->speed = TIME_FROM_FLOAT(speed);
+}
+
+void AnimSpriteSetSpeedFixed(AnimSprite *sprite, uint32_t speed)
+{
+	sprite->speed = TIME_FROM_FIXED(speed);
 }
 
 float AnimSpriteGetTime(AnimSprite *sprite)
 {
-	return sprite->time;
+	return TIME_TO_FLOAT(sprite->time);
 }
 
-void AnimSpriteUpdate(AnimSprite *sprite, float dt)
+uint32_t AnimSpriteGetTimeFixed(AnimSprite *sprite)
+{
+	return TIME_TO_FIXED(sprite->time);
+}
+
+static void Update(AnimSprite *sprite, AnimTime dt)
 {
 	ASPRAnim *anim = sprite->data->anims[sprite->anim_idx];
-	float speed = sprite->speed;
-	if(speed == 0.0f || sprite->pause) {
+	AnimTime speed = sprite->speed;
+	if(speed == 0 || sprite->pause) {
 		return;
 	}
-	sprite->time += speed*dt;
-	while(sprite->loop && sprite->time > anim->total_time) {
-		sprite->time -= anim->total_time;
+	sprite->time = TIME_ADD(sprite->time, TIME_MUL(speed, dt));
+	AnimTime total_time = TIME_FROM_TICKS(anim->total_time);
+	while(sprite->loop && sprite->time > total_time) {
+		sprite->time -= total_time;
 		sprite->frame_idx = 0;
 		sprite->dirty = true;
 	}
-	if(sprite->frame_idx < anim->num_frames+1) {
-		while(sprite->time > anim->frames[sprite->frame_idx+1].time) {
-			sprite->frame_idx++;
-			sprite->dirty = true;
-			if(sprite->frame_idx >= anim->num_frames+1) {
-				break;
-			}
-		}
-	}		
+	// Non-looping animations stay on their last frame
+	while(sprite->frame_idx < anim->num_frames-1 && sprite->time > TIME_FROM_TICKS(anim->frames[sprite->frame_idx+1].time)) {
+		sprite->frame_idx++;
+		sprite->dirty = true;
+	}
+	PrefetchNextFrame(sprite);
+}
+
+void AnimSpriteUpdate(AnimSprite *sprite, float dt)
+{
+	assertf(dt >= 0, "Time step must be non-negative");
+	Update(sprite, TIME_FROM_FLOAT(dt));
+}
+
+void AnimSpriteUpdateFixed(AnimSprite *sprite, uint32_t dt)
+{
+	Update(sprite, TIME_FROM_FIXED(dt));
 }
 
 sprite_t *AnimSpriteGetSprite(AnimSprite *sprite)
 {
-	int buffer;
 	if(sprite->data->sprite_data) {
-		return sprite->data->sprite_data->sprite[GetImageIdx(sprite)];
+		return sprite->data->sprite_data->sprite[GetSpriteIdx(sprite)];
+	}
+	if(sprite->data->chunks) {
+		// The first animation is loaded once the sprite is first drawn
+		UpdateSpriteFrame(sprite);
+		return GetChunkSprite(sprite->sheet, sprite->anim_idx, sprite->frame_idx);
 	}
 	if(sprite->dirty) {
 		UpdateSpriteFrame(sprite);
 		sprite->dirty = false;
 	}
-	buffer = sprite->buffer;
-	if(buffer == 0) {
-		buffer = MAX_STREAM_BUFS-1;
-	} else {
-		buffer--;
+	return stream_pool.slots[sprite->slot].buf;
+}
+
+void AnimSpriteGetRect(AnimSprite *sprite, AnimSpriteRect *rect)
+{
+	ASPRImage *image = GetImage(sprite);
+	rect->s = image->s;
+	rect->t = image->t;
+	rect->width = image->width;
+	rect->height = image->height;
+	rect->x_ofs = image->x_ofs;
+	rect->y_ofs = image->y_ofs;
+}
+
+uint16_t *AnimSpriteGetPalette(AnimSprite *sprite, int *num_colors)
+{
+	*num_colors = sprite->data->palette_size;
+	if(sprite->data->palette_size == 0) {
+		return NULL;
+	}
+	return sprite->data->palette;
+}
+
+void AnimSpriteGetPrefetchStats(AnimSpritePrefetchStats *stats)
+{
+	*stats = prefetch_stats;
+}
+
+void AnimSpriteResetPrefetchStats(void)
+{
+	memset(&prefetch_stats, 0, sizeof(prefetch_stats));
+}
+
+void AnimSpriteSetPoolBudget(uint32_t budget)
+{
+	stream_pool.budget = budget;
+	PoolMakeRoom(0);
+}
+
+void AnimSpriteSetCacheBudget(uint32_t budget)
+{
+	stream_pool.cache_budget = budget;
+}
+
+// Runs in the RDP interrupt once everything queued before frame started is drawn
+static void PoolFrameDrawn(void *frame)
+{
+	stream_pool.rdp_frame = (uint32_t)(uintptr_t)frame;
+}
+
+void AnimSpritePoolNextFrame(void)
+{
+	stream_pool.frame++;
+	stream_pool.track_frames = true;
+	rdpq_sync_full(PoolFrameDrawn, (void *)(uintptr_t)stream_pool.frame);
+}
+
+void AnimSpriteGetPoolStats(AnimSpritePoolStats *stats)
+{
+	*stats = stream_pool.stats;
+}
+
+typedef struct anim_sprite_group {
+	ASPRSheet *sheet;
+	int count;
+	int capacity;
+	// Playback state of each instance
+	AnimTime *time;
+	AnimTime *speed;
+	uint16_t *anim_idx;
+	uint16_t *frame_idx;
+	bool *loop;
+	bool *dirty; // Animation set since the last update
+	int *slot; // Stream pool buffer of the shown frame, -1 if none
+	// Instances whose frame changed in the last update
+	uint16_t *changed;
+	int num_changed;
+	// Frame timing of every animation flattened out of the sheet
+	AnimTime *anim_total_time;
+	uint16_t *anim_first_frame;
+	uint16_t *anim_num_frames;
+	AnimTime *frame_time;
+} AnimSpriteGroup;
+
+AnimSpriteGroup *AnimSpriteGroupCreate(const char *path, int capacity)
+{
+	assertf(strncmp(path, "rom:/", 5) == 0, "Cannot open %s: File must be in ROM (rom:/)", path);
+	AnimSpriteGroup *group = malloc(sizeof(AnimSpriteGroup));
+	group->sheet = AcquireSheet(path);
+	ASPRData *data = group->sheet->data;
+	assertf(!data->anim_deltas, "%s: Sprite groups cannot play delta encoded sheets", path);
+	group->count = 0;
+	group->capacity = capacity;
+	group->time = malloc(capacity*sizeof(AnimTime));
+	group->speed = malloc(capacity*sizeof(AnimTime));
+	group->anim_idx = malloc(capacity*sizeof(uint16_t));
+	group->frame_idx = malloc(capacity*sizeof(uint16_t));
+	group->loop = malloc(capacity*sizeof(bool));
+	group->dirty = malloc(capacity*sizeof(bool));
+	group->slot = malloc(capacity*sizeof(int));
+	group->changed = malloc(capacity*sizeof(uint16_t));
+	group->num_changed = 0;
+	group->anim_total_time = malloc(data->anim_count*sizeof(AnimTime));
+	group->anim_first_frame = malloc(data->anim_count*sizeof(uint16_t));
+	group->anim_num_frames = malloc(data->anim_count*sizeof(uint16_t));
+	uint32_t num_frames = 0;
+	for(uint32_t i=0; i<data->anim_count; i++) {
+		num_frames += data->anims[i]->num_frames;
+	}
+	group->frame_time = malloc(num_frames*sizeof(AnimTime));
+	num_frames = 0;
+	for(uint32_t i=0; i<data->anim_count; i++) {
+		ASPRAnim *anim = data->anims[i];
+		group->anim_total_time[i] = TIME_FROM_TICKS(anim->total_time);
+		group->anim_first_frame[i] = num_frames;
+		group->anim_num_frames[i] = anim->num_frames;
+		for(uint32_t j=0; j<anim->num_frames; j++) {
+			group->frame_time[num_frames++] = TIME_FROM_TICKS(anim->frames[j].time);
+		}
+	}
+	return group;
+}
+
+void AnimSpriteGroupDelete(AnimSpriteGroup *group)
+{
+	for(int i=0; i<group->count; i++) {
+		PoolRelease(group->slot[i]);
+		ReleaseChunk(group->sheet, group->anim_idx[i]);
+	}
+	ReleaseSheet(group->sheet);
+	free(group->time);
+	free(group->speed);
+	free(group->anim_idx);
+	free(group->frame_idx);
+	free(group->loop);
+	free(group->dirty);
+	free(group->slot);
+	free(group->changed);
+	free(group->anim_total_time);
+	free(group->anim_first_frame);
+	free(group->anim_num_frames);
+	free(group->frame_time);
+	free(group);
+}
+
+int AnimSpriteGroupAdd(AnimSpriteGroup *group, int anim_idx, bool loop)
+{
+	assertf(group->count < group->capacity, "Sprite group is full (%d instances)", group->capacity);
+	int index = group->count++;
+	group->time[index] = 0;
+	group->speed[index] = TIME_ONE;
+	group->frame_idx[index] = 0;
+	group->loop[index] = loop;
+	group->slot[index] = -1;
+	// Held here so setting the animation below swaps it for itself
+	AcquireChunk(group->sheet, anim_idx);
+	group->anim_idx[index] = anim_idx;
+	AnimSpriteGroupSetAnim(group, index, anim_idx);
+	return index;
+}
+
+int AnimSpriteGroupRemove(AnimSpriteGroup *group, int index)
+{
+	PoolRelease(group->slot[index]);
+	ReleaseChunk(group->sheet, group->anim_idx[index]);
+	int last = --group->count;
+	// The changed list drops the removed instance and follows the moved one
+	int num_changed = 0;
+	for(int i=0; i<group->num_changed; i++) {
+		if(group->changed[i] != index) {
+			group->changed[num_changed++] = (group->changed[i] == last) ? index : group->changed[i];
+		}
+	}
+	group->num_changed = num_changed;
+	if(index == last) {
+		return -1;
+	}
+	group->time[index] = group->time[last];
+	group->speed[index] = group->speed[last];
+	group->anim_idx[index] = group->anim_idx[last];
+	group->frame_idx[index] = group->frame_idx[last];
+	group->loop[index] = group->loop[last];
+	group->dirty[index] = group->dirty[last];
+	group->slot[index] = group->slot[last];
+	return last;
+}
+
+void AnimSpriteGroupSetAnim(AnimSpriteGroup *group, int index, int anim_idx)
+{
+	assertf(anim_idx >= 0 && anim_idx < (int)group->sheet->data->anim_count, "Animation index %d out of range.", anim_idx);
+	AcquireChunk(group->sheet, anim_idx);
+	ReleaseChunk(group->sheet, group->anim_idx[index]);
+	group->anim_idx[index] = anim_idx;
+	group->time[index] = 0;
+	group->frame_idx[index] = 0;
+	group->dirty[index] = true;
+}
+
+void AnimSpriteGroupSetLoop(AnimSpriteGroup *group, int index, bool loop)
+{
+	group->loop[index] = loop;
+}
+
+void AnimSpriteGroupSetSpeed(AnimSpriteGroup *group, int index, float speed)
+{
+	assertf(speed >= 0, "Speed must be non-negative");
+	group->speed[index] = TIME_FROM_FLOAT(speed);
+}
+
+void AnimSpriteGroupSetSpeedFixed(AnimSpriteGroup *group, int index, uint32_t speed)
+{
+	group->speed[index] = TIME_FROM_FIXED(speed);
+}
+
+static int GroupUpdate(AnimSpriteGroup *group, AnimTime dt)
+{
+	int num_changed = 0;
+	for(int i=0; i<group->count; i++) {
+		AnimTime speed = group->speed[i];
+		if(speed == 0) {
+			if(group->dirty[i]) {
+				group->dirty[i] = false;
+				group->changed[num_changed++] = i;
+			}
+			continue;
+		}
+		int anim = group->anim_idx[i];
+		AnimTime time = TIME_ADD(group->time[i], TIME_MUL(speed, dt));
+		int frame = group->frame_idx[i];
+		// Instances whose animation was set show a new sprite even on frame 0
+		bool changed = group->dirty[i];
+		group->dirty[i] = false;
+		AnimTime total_time = group->anim_total_time[anim];
+		if(group->loop[i] && time > total_time) {
+			do {
+				time -= total_time;
+			} while(time > total_time);
+			changed = changed || frame != 0;
+			frame = 0;
+		}
+		const AnimTime *frame_time = &group->frame_time[group->anim_first_frame[anim]];
+		int last_frame = group->anim_num_frames[anim]-1;
+		while(frame < last_frame && time > frame_time[frame+1]) {
+			frame++;
+			changed = true;
+		}
+		group->time[i] = time;
+		group->frame_idx[i] = frame;
+		if(changed) {
+			group->changed[num_changed++] = i;
+		}
+	}
+	group->num_changed = num_changed;
+	return num_changed;
+}
+
+int AnimSpriteGroupUpdate(AnimSpriteGroup *group, float dt)
+{
+	assertf(dt >= 0, "Time step must be non-negative");
+	return GroupUpdate(group, TIME_FROM_FLOAT(dt));
+}
+
+int AnimSpriteGroupUpdateFixed(AnimSpriteGroup *group, uint32_t dt)
+{
+	return GroupUpdate(group, TIME_FROM_FIXED(dt));
+}
+
+const uint16_t *AnimSpriteGroupGetChanged(AnimSpriteGroup *group)
+{
+	return group->changed;
+}
+
+int AnimSpriteGroupGetNumChanged(AnimSpriteGroup *group)
+{
+	return group->num_changed;
+}
+
+static ASPRImage *GetGroupImage(AnimSpriteGroup *group, int index)
+{
+	ASPRData *data = group->sheet->data;
+	ASPRAnim *anim = data->anims[group->anim_idx[index]];
+	return &data->images[anim->frames[group->frame_idx[index]].sprite_idx];
+}
+
+sprite_t *AnimSpriteGroupGetSprite(AnimSpriteGroup *group, int index)
+{
+	ASPRData *data = group->sheet->data;
+	uint32_t image = GetGroupImage(group, index)->sprite_idx;
+	if(data->sprite_data) {
+		return data->sprite_data->sprite[image];
+	}
+	if(data->chunks) {
+		return GetChunkSprite(group->sheet, group->anim_idx[index], group->frame_idx[index]);
+	}
+	int slot = group->slot[index];
+	if(slot == -1 || stream_pool.slots[slot].sprite_idx != image) {
+		bool loaded;
+		PoolRelease(slot);
+		slot = PoolAcquire(data, image, GetRawSize(data, image), false, &loaded);
+		if(!loaded) {
+			LoadSheetSprite(group->sheet, stream_pool.slots[slot].buf, image);
+		}
+		group->slot[index] = slot;
+	}
+	return stream_pool.slots[slot].buf;
+}
+
+void AnimSpriteGroupGetRect(AnimSpriteGroup *group, int index, AnimSpriteRect *rect)
+{
+	ASPRImage *image = GetGroupImage(group, index);
+	rect->s = image->s;
+	rect->t = image->t;
+	rect->width = image->width;
+	rect->height = image->height;
+	rect->x_ofs = image->x_ofs;
+	rect->y_ofs = image->y_ofs;
+}
+
+void AnimSpriteGetDecompressStats(AnimSpriteDecompressStats *stats)
+{
+	*stats = decompress_stats;
+}
+
+static void CheckAnimIndex(AnimSprite *sprite, int anim_idx)
+{
+	assertf(anim_idx >= 0 && anim_idx < (int)sprite->data->anim_count, "Animation index %d out of range.", anim_idx);
+}
+
+void AnimSpritePreloadAnims(AnimSprite *sprite, const int *anim_idx, int count)
+{
+	if(!sprite->sheet->chunks) {
+		return;
+	}
+	for(int i=0; i<count; i++) {
+		CheckAnimIndex(sprite, anim_idx[i]);
+		LoadChunk(sprite->sheet, anim_idx[i]);
+		sprite->sheet->chunks[anim_idx[i]].preload = true;
+	}
+}
+
+void AnimSpriteUnloadAnims(AnimSprite *sprite, const int *anim_idx, int count)
+{
+	if(!sprite->sheet->chunks) {
+		return;
+	}
+	for(int i=0; i<count; i++) {
+		CheckAnimIndex(sprite, anim_idx[i]);
+		SheetChunk *chunk = &sprite->sheet->chunks[anim_idx[i]];
+		chunk->preload = false;
+		EvictChunk(chunk);
+	}
+}
+
+bool AnimSpriteIsAnimLoaded(AnimSprite *sprite, int anim_idx)
+{
+	CheckAnimIndex(sprite, anim_idx);
+	if(!sprite->sheet->chunks) {
+		return true;
+	}
+	return sprite->sheet->chunks[anim_idx].buf != NULL;
+}
+
+void AnimSpriteEvictAnims(void)
+{
+	for(ASPRSheet *sheet = sheet_list; sheet; sheet = sheet->next) {
+		if(!sheet->chunks) {
+			continue;
+		}
+		for(uint32_t i=0; i<sheet->data->anim_count; i++) {
+			EvictChunk(&sheet->chunks[i]);
+		}
 	}
-	return sprite->stream_buf[buffer];
 }
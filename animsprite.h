@@ -5,17 +5,155 @@
 
 typedef struct anim_sprite AnimSprite;
 
+// Part of the sprite returned by AnimSpriteGetSprite that holds the current
+// frame, and where to draw it relative to the sprite position. The offset is
+// non-zero for frames trimmed by mkanimspr --trim.
+// Sheets built with mkanimspr --atlas share one sprite per page between many
+// frames, which saves sprite headers and stream reads, not TMEM uploads. Each
+// blit of a rect, for example with rdpq_sprite_blit and its s0/t0/width/height
+// parameters, still loads that rect into TMEM, as pages are usually too big to
+// be loaded whole.
+typedef struct anim_sprite_rect {
+	int s;
+	int t;
+	int width;
+	int height;
+	int x_ofs;
+	int y_ofs;
+} AnimSpriteRect;
+
+// Counters of the stream mode prefetcher, summed over all sprites. Each update
+// starts reading the next frame of the animation into the spare stream buffer.
+typedef struct anim_sprite_prefetch_stats {
+	uint32_t issued; // Frames read ahead
+	uint32_t used; // Read ahead frames that were shown
+	uint32_t late; // Shown frames whose read had not finished when needed
+	uint32_t wasted; // Read ahead frames dropped for a different frame
+} AnimSpritePrefetchStats;
+
+// State of the buffer pool that stream mode sprites borrow their frames from.
+// Sprites showing the same frame of the same sheet share one buffer.
+typedef struct anim_sprite_pool_stats {
+	uint32_t num_buffers;
+	uint32_t bytes;
+	uint32_t peak_bytes;
+	uint32_t shared; // Frames shown from a buffer already held by another sprite
+	uint32_t over_budget; // Buffers allocated beyond the budget because none was idle
+	uint32_t hits; // Frames found in a buffer no sprite held, without reading ROM
+	uint32_t misses; // Frames read from ROM
+	uint32_t evictions; // Cached frames dropped to make room for others
+} AnimSpritePoolStats;
+
+// Work done decompressing sprites streamed from sheets built with
+// mkanimspr --compress, summed over all sprites
+typedef struct anim_sprite_decompress_stats {
+	uint32_t frames;
+	uint32_t bytes_read; // Compressed bytes read from ROM
+	uint32_t bytes_written; // Decompressed bytes
+	uint64_t ticks; // CPU time spent, convert with TICKS_TO_US
+} AnimSpriteDecompressStats;
+
+// Sprites loaded from the same path share one copy of the sheet, which is
+// freed along with the last of them. Only the first load reads the file.
 AnimSprite *AnimSpriteLoad(const char *path);
 void AnimSpriteDelete(AnimSprite *sprite);
 void AnimSpriteSetAnim(AnimSprite *sprite, const char *name);
+// Selects an animation by its index in the sheet, which is what the enum
+// written by mkanimspr --header-dir holds. No name lookup is done.
+void AnimSpriteSetAnimIndex(AnimSprite *sprite, int anim_idx);
+// Returns the index of the named animation, or -1 if there is none
+int AnimSpriteFindAnim(AnimSprite *sprite, const char *name);
 void AnimSpriteSetLoop(AnimSprite *sprite, bool loop);
 void AnimSpriteSetPause(AnimSprite *sprite, bool pause);
 
+// Times, speeds and time steps must be non-negative
 void AnimSpriteSetTime(AnimSprite *sprite, float time);
 void AnimSpriteSetSpeed(AnimSprite *sprite, float time);
 float AnimSpriteGetTime(AnimSprite *sprite);
 
 void AnimSpriteUpdate(AnimSprite *sprite, float dt);
+
+// Same as above with times and speeds in 16.16 fixed point (0x10000 is one
+// tick or a speed of 1). Builds with ANIMSPRITE_FIXED_TIME defined keep the
+// timeline in this format, and these functions then do no float math.
+// Float times and speeds are rounded to the nearest 1/65536 there. Multiples
+// of 1/256 (0.25, 0.5, 1.5...) play the same frames as the float build, other
+// values may change frame one update earlier or later.
+void AnimSpriteSetTimeFixed(AnimSprite *sprite, uint32_t time);
+void AnimSpriteSetSpeedFixed(AnimSprite *sprite, uint32_t speed);
+uint32_t AnimSpriteGetTimeFixed(AnimSprite *sprite);
+void AnimSpriteUpdateFixed(AnimSprite *sprite, uint32_t dt);
+
+// Streamed sprites are returned in a buffer borrowed from the stream pool, see
+// AnimSpritePoolNextFrame
 sprite_t *AnimSpriteGetSprite(AnimSprite *sprite);
+void AnimSpriteGetRect(AnimSprite *sprite, AnimSpriteRect *rect);
+// Returns the palette shared by all paletted frames of the sheet, or NULL if
+// every frame has its own. Upload it to TMEM once before drawing frames.
+uint16_t *AnimSpriteGetPalette(AnimSprite *sprite, int *num_colors);
+
+// Limits the memory used by stream buffers, 0 for no limit. Only buffers that
+// no sprite shows are freed to stay within it.
+void AnimSpriteSetPoolBudget(uint32_t budget);
+// Call once per display frame after its drawing is queued, for example after
+// rdpq_detach_show. Buffers released before the call are reused once the RDP
+// has drawn everything queued before it, which is tracked with rdpq_sync_full.
+// Until it is first called, released buffers are reused right away, which is
+// only safe if the RDP is done with every sprite returned before the next
+// AnimSpriteGetSprite.
+void AnimSpritePoolNextFrame(void);
+// Keeps frames that are no longer shown cached in their buffers, up to budget
+// bytes, so looping animations stop reading ROM. The least recently shown
+// frames are evicted first. The cache is disabled with a budget of 0.
+void AnimSpriteSetCacheBudget(uint32_t budget);
+void AnimSpriteGetPoolStats(AnimSpritePoolStats *stats);
+void AnimSpriteGetDecompressStats(AnimSpriteDecompressStats *stats);
+void AnimSpriteGetPrefetchStats(AnimSpritePrefetchStats *stats);
+void AnimSpriteResetPrefetchStats(void);
+
+// Sheets built with mkanimspr --chunked read the sprites of an animation from
+// ROM when it is first shown and keep them until they are evicted. These calls
+// do nothing for other sheets, where every animation is always loaded.
+
+// Loads the animations the game expects to show and keeps them loaded until
+// they are unloaded
+void AnimSpritePreloadAnims(AnimSprite *sprite, const int *anim_idx, int count);
+// Stops keeping preloaded chunks and evicts them if they are not shown
+void AnimSpriteUnloadAnims(AnimSprite *sprite, const int *anim_idx, int count);
+bool AnimSpriteIsAnimLoaded(AnimSprite *sprite, int anim_idx);
+// Frees the chunks of every sheet that are neither shown nor preloaded.
+// Chunks released in a display frame the RDP has not finished drawing are
+// kept, since it may still be reading them.
+void AnimSpriteEvictAnims(void);
+
+// Many instances of one sheet played back together. The playback state of
+// all instances is kept in arrays and advanced in a single loop. Instances
+// are addressed by index and always play from the start when their animation
+// is set. A speed of 0 pauses an instance.
+typedef struct anim_sprite_group AnimSpriteGroup;
+
+AnimSpriteGroup *AnimSpriteGroupCreate(const char *path, int capacity);
+void AnimSpriteGroupDelete(AnimSpriteGroup *group);
+// Returns the index of the new instance
+int AnimSpriteGroupAdd(AnimSpriteGroup *group, int anim_idx, bool loop);
+// Moves the last instance into the removed one's place and returns its old
+// index, or -1 if the removed instance was the last one. The removed instance
+// leaves the changed list and the moved one stays in it under its new index,
+// so the list can shrink.
+int AnimSpriteGroupRemove(AnimSpriteGroup *group, int index);
+void AnimSpriteGroupSetAnim(AnimSpriteGroup *group, int index, int anim_idx);
+void AnimSpriteGroupSetLoop(AnimSpriteGroup *group, int index, bool loop);
+void AnimSpriteGroupSetSpeed(AnimSpriteGroup *group, int index, float speed);
+void AnimSpriteGroupSetSpeedFixed(AnimSpriteGroup *group, int index, uint32_t speed);
+// Advances every instance and returns how many of them changed frame, counting
+// instances added or given an animation since the last update. Their indices
+// are returned by AnimSpriteGroupGetChanged until the next update.
+int AnimSpriteGroupUpdate(AnimSpriteGroup *group, float dt);
+int AnimSpriteGroupUpdateFixed(AnimSpriteGroup *group, uint32_t dt);
+const uint16_t *AnimSpriteGroupGetChanged(AnimSpriteGroup *group);
+// Length of the changed list, which AnimSpriteGroupRemove may shorten
+int AnimSpriteGroupGetNumChanged(AnimSpriteGroup *group);
+sprite_t *AnimSpriteGroupGetSprite(AnimSpriteGroup *group, int index);
+void AnimSpriteGroupGetRect(AnimSpriteGroup *group, int index, AnimSpriteRect *rect);
 
 #endif
\ No newline at end of file
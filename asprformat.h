@@ -3,9 +3,12 @@
 
 #include <stdint.h>
 
+#define ASPR_MAGIC 0x41535052 // 'ASPR'
+#define ASPR_VERSION 9
+
 typedef struct aspr_frame_data {
 	uint16_t time;
-	uint16_t sprite_idx;
+	uint16_t sprite_idx; // Index into ASPRData::images
 } ASPRFrameData;
 
 typedef struct aspr_anim {
@@ -15,17 +18,69 @@ typedef struct aspr_anim {
 	ASPRFrameData frames[];
 } ASPRAnim;
 
+// Location of a frame image inside a stored sprite. Without an atlas every
+// image covers its whole sprite.
+typedef struct aspr_image {
+	uint16_t sprite_idx;
+	uint16_t s;
+	uint16_t t;
+	uint16_t width;
+	uint16_t height;
+	int16_t x_ofs;
+	int16_t y_ofs;
+	uint16_t padding;
+} ASPRImage;
+
+// Stream data that turns the sprite of the previous frame of an animation into
+// the sprite of this frame. The record holds a span count followed by spans of
+// uint32_t offset, uint32_t size and the new bytes padded to 4 bytes.
+typedef struct aspr_delta {
+	uint32_t ofs; // Offset of the record in the sprite data file, 0 for keyframes
+	uint32_t size;
+} ASPRDelta;
+
 typedef struct aspr_sprite_data {
 	uint32_t spr_max_size;
 	void *sprite[];
 } ASPRSpriteData;
 
+// Where the sprites of a streamed sheet are found in the .aspr.dat file.
+// Sprites whose stored size is below their raw size are LZ4 blocks.
+typedef struct aspr_stream_data {
+	uint32_t spr_max_size; // Largest sprite after decompression
+	uint32_t comp_max_size; // Largest compressed sprite, 0 if none are compressed
+	uint32_t *raw_size; // Size of each sprite after decompression, NULL unless compressed or delta encoded
+	uint32_t sprite_ofs[]; // sprite_count+1 entries, the last one is the end of the sprites
+} ASPRStreamData;
+
+// Sprites shown by one animation of a chunked sheet, stored together in the
+// .aspr.dat file and read as a whole when the animation is first shown
+typedef struct aspr_chunk {
+	uint32_t ofs; // Offset of the chunk in the sprite data file
+	uint32_t size;
+	uint32_t *frame_ofs; // Offset of the sprite of each frame within the chunk
+} ASPRChunk;
+
 typedef struct aspr_data {
 	uint32_t magic;
+	uint32_t version;
 	uint32_t anim_count;
 	uint32_t sprite_count;
+	uint32_t image_count;
+	uint32_t palette_size;
+	uint32_t delta_max_size;
+	uint32_t reloc_count;
+	uint32_t reloc_ofs; // File offset of reloc_count uint32_t offsets of the pointers to relocate
+	uint32_t rdp_data_ofs; // The palette and embedded sprites start here and run to the end of the file
 	ASPRSpriteData *sprite_data;
+	ASPRStreamData *stream_data; // Set instead of sprite_data for streamed sheets
+	ASPRChunk *chunks; // One per animation, set instead of sprite_data for chunked sheets
+	ASPRImage *images;
+	uint16_t *palette; // Shared by all paletted sprites when palette_size is non-zero
+	ASPRDelta **anim_deltas; // Per animation frame deltas, NULL if not delta encoded
+	uint32_t anim_hash_mask; // Size of anim_hash minus 1, the size is a power of two
+	uint16_t *anim_hash; // Animation indices by FNV-1a hash of their name, 0xFFFF if empty
 	ASPRAnim *anims[];
 } ASPRData;
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,198 @@
+#include "libdragon.h"
+#include "animsprite.h"
+
+#include <time.h>
+
+// Replays a scripted animation sequence over many instances of a sheet and
+// reports the time taken per update, once with individual AnimSprites and
+// once with an AnimSpriteGroup.
+
+typedef struct script_step {
+	const char *anim;
+	int frames;
+	float speed;
+	bool loop;
+} ScriptStep;
+
+// A paddle powering up and down again
+static const ScriptStep script[] = {
+	{ "idle_small", 120, 1.0f, true },
+	{ "grow", 60, 1.0f, false },
+	{ "idle_big", 90, 1.0f, true },
+	{ "bounce", 45, 1.5f, true },
+	{ "idle_big", 30, 1.0f, true },
+	{ "shrink", 60, 1.0f, false },
+	{ "bounce", 60, 0.5f, true },
+};
+
+#define NUM_STEPS (sizeof(script)/sizeof(script[0]))
+
+typedef struct instance {
+	int step;
+	int frames_left;
+} Instance;
+
+static int num_instances = 4096;
+static int num_frames = 600;
+static int anim_idx[NUM_STEPS];
+static volatile uintptr_t sink;
+
+static double NowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+// Spreads the instances over the script so they do not all switch at once
+static void InitInstances(Instance *instances)
+{
+	uint32_t seed = 12345;
+	for(int i=0; i<num_instances; i++) {
+		seed = seed*1664525+1013904223;
+		instances[i].step = (seed >> 16) % NUM_STEPS;
+		instances[i].frames_left = 1+((seed >> 8) % script[instances[i].step].frames);
+	}
+}
+
+// Returns true when the instance moves on to its next step
+static bool AdvanceInstance(Instance *instance)
+{
+	if(--instance->frames_left != 0) {
+		return false;
+	}
+	instance->step = (instance->step+1) % NUM_STEPS;
+	instance->frames_left = script[instance->step].frames;
+	return true;
+}
+
+static void StartStep(AnimSprite *sprite, const ScriptStep *step, int index)
+{
+	AnimSpriteSetAnimIndex(sprite, anim_idx[index]);
+	AnimSpriteSetLoop(sprite, step->loop);
+	AnimSpriteSetSpeed(sprite, step->speed);
+}
+
+static double BenchSprites(const char *path)
+{
+	AnimSprite **sprites = malloc(num_instances*sizeof(AnimSprite *));
+	Instance *instances = malloc(num_instances*sizeof(Instance));
+	InitInstances(instances);
+	for(int i=0; i<num_instances; i++) {
+		sprites[i] = AnimSpriteLoad(path);
+		StartStep(sprites[i], &script[instances[i].step], instances[i].step);
+	}
+	double start = NowNs();
+	for(int frame=0; frame<num_frames; frame++) {
+		for(int i=0; i<num_instances; i++) {
+			if(AdvanceInstance(&instances[i])) {
+				StartStep(sprites[i], &script[instances[i].step], instances[i].step);
+			}
+			AnimSpriteUpdate(sprites[i], 1);
+			sink += (uintptr_t)AnimSpriteGetSprite(sprites[i]);
+		}
+		AnimSpritePoolNextFrame();
+	}
+	double elapsed = NowNs()-start;
+	for(int i=0; i<num_instances; i++) {
+		AnimSpriteDelete(sprites[i]);
+	}
+	free(instances);
+	free(sprites);
+	return elapsed/((double)num_frames*num_instances);
+}
+
+static double BenchGroup(const char *path)
+{
+	AnimSpriteGroup *group = AnimSpriteGroupCreate(path, num_instances);
+	Instance *instances = malloc(num_instances*sizeof(Instance));
+	InitInstances(instances);
+	for(int i=0; i<num_instances; i++) {
+		const ScriptStep *step = &script[instances[i].step];
+		AnimSpriteGroupAdd(group, anim_idx[instances[i].step], step->loop);
+		AnimSpriteGroupSetSpeed(group, i, step->speed);
+	}
+	double start = NowNs();
+	for(int frame=0; frame<num_frames; frame++) {
+		for(int i=0; i<num_instances; i++) {
+			if(AdvanceInstance(&instances[i])) {
+				const ScriptStep *step = &script[instances[i].step];
+				AnimSpriteGroupSetAnim(group, i, anim_idx[instances[i].step]);
+				AnimSpriteGroupSetLoop(group, i, step->loop);
+				AnimSpriteGroupSetSpeed(group, i, step->speed);
+			}
+		}
+		int num_changed = AnimSpriteGroupUpdate(group, 1);
+		const uint16_t *changed = AnimSpriteGroupGetChanged(group);
+		for(int i=0; i<num_changed; i++) {
+			sink += (uintptr_t)AnimSpriteGroupGetSprite(group, changed[i]);
+		}
+		AnimSpritePoolNextFrame();
+	}
+	double elapsed = NowNs()-start;
+	AnimSpriteGroupDelete(group);
+	free(instances);
+	return elapsed/((double)num_frames*num_instances);
+}
+
+static double BenchLookup(const char *path)
+{
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	int count = num_instances*16;
+	double start = NowNs();
+	for(int i=0; i<count; i++) {
+		sink += AnimSpriteFindAnim(sprite, script[i % NUM_STEPS].anim);
+	}
+	double elapsed = NowNs()-start;
+	AnimSpriteDelete(sprite);
+	return elapsed/count;
+}
+
+static void PrintUsage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n instances] [-f frames] [-d rom dir] <rom:/sheet.aspr>...\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	for(i=1; i<argc && argv[i][0] == '-'; i++) {
+		if(i+1 == argc) {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+		if(!strcmp(argv[i], "-n")) {
+			num_instances = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-f")) {
+			num_frames = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-d")) {
+			host_set_rom_dir(argv[++i]);
+		} else {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+	if(i == argc || num_instances <= 0 || num_frames <= 0) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	printf("%d instances, %d frames\n", num_instances, num_frames);
+	for(; i<argc; i++) {
+		const char *path = argv[i];
+		AnimSprite *sprite = AnimSpriteLoad(path);
+		for(size_t j=0; j<NUM_STEPS; j++) {
+			anim_idx[j] = AnimSpriteFindAnim(sprite, script[j].anim);
+			assertf(anim_idx[j] >= 0, "%s has no animation %s", path, script[j].anim);
+		}
+		AnimSpriteDelete(sprite);
+		printf("%s\n", path);
+		printf("  AnimSprite:      %8.1f ns/update\n", BenchSprites(path));
+		printf("  AnimSpriteGroup: %8.1f ns/update\n", BenchGroup(path));
+		printf("  Name lookup:     %8.1f ns/lookup\n", BenchLookup(path));
+		AnimSpritePoolStats stats;
+		AnimSpriteGetPoolStats(&stats);
+		printf("  Pool: %lu hits, %lu misses, %lu evictions\n",
+			(unsigned long)stats.hits, (unsigned long)stats.misses, (unsigned long)stats.evictions);
+	}
+	return 0;
+}
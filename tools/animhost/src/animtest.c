@@ -0,0 +1,718 @@
+// Tests of the AnimSprite runtime against sheets built by mkanimspr --host.
+// The runtime is included so its internal functions can be checked directly.
+#include "animsprite.c"
+
+static int num_checks;
+static int num_failed;
+
+#define CHECK(expr) do { \
+	num_checks++; \
+	if(!(expr)) { \
+		num_failed++; \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+	} \
+} while(0)
+
+#define SHEET_EMBED "rom:/paddle.aspr"
+#define SHEET_STREAM "rom:/paddle_stream_raw.aspr"
+#define SHEET_COMPRESS "rom:/paddle_stream.aspr"
+#define SHEET_DELTA "rom:/paddle_delta.aspr"
+#define SHEET_CHUNKED "rom:/paddle_chunked.aspr"
+
+static const char *anim_names[] = { "grow", "shrink", "bounce", "idle_big", "idle_small" };
+
+#define NUM_ANIM_NAMES (sizeof(anim_names)/sizeof(anim_names[0]))
+
+// Frame shown at a tick of an animation, worked out from the frame start
+// times the way the sheet describes them
+static int ExpectedFrame(ASPRAnim *anim, uint32_t time, bool loop)
+{
+	if(loop && anim->total_time != 0) {
+		while(time > anim->total_time) {
+			time -= anim->total_time;
+		}
+	}
+	int frame = 0;
+	for(int i=1; i<anim->num_frames; i++) {
+		if(time > anim->frames[i].time) {
+			frame = i;
+		}
+	}
+	return frame;
+}
+
+static void TestRelocation(const char *path)
+{
+	int size;
+	uint8_t *raw = asset_load(path, &size);
+	uint32_t writeback_bytes = host_writeback_bytes();
+	ASPRData *data = LoadASPR(path);
+	// Uncompressed sheets are read by DMA and need no cache writeback
+	CHECK(host_writeback_bytes() == writeback_bytes);
+	ASPRData *raw_data = (ASPRData *)raw;
+	CHECK(raw_data->reloc_ofs+raw_data->reloc_count*sizeof(uint32_t) <= (uint32_t)size);
+	uint32_t *relocs = (uint32_t *)(raw+raw_data->reloc_ofs);
+	for(uint32_t i=0; i<raw_data->reloc_count; i++) {
+		CHECK(relocs[i] % sizeof(void *) == 0 && relocs[i] < (uint32_t)size);
+		// Pointers hold their file offset before relocation
+		uint32_t ofs = (uint32_t)*(uintptr_t *)(raw+relocs[i]);
+		// The last entry of the sprite table points at the end of the file
+		CHECK(ofs <= (uint32_t)size);
+		CHECK(*(uint8_t **)((uint8_t *)data+relocs[i]) == (uint8_t *)data+ofs);
+	}
+	CHECK(data->images >= (ASPRImage *)data && (uint8_t *)(data->images+data->image_count) <= (uint8_t *)data+size);
+	for(uint32_t i=0; i<data->anim_count; i++) {
+		ASPRAnim *anim = data->anims[i];
+		CHECK((uint8_t *)anim > (uint8_t *)data && (uint8_t *)anim < (uint8_t *)data+size);
+		CHECK(anim->name > (char *)data && anim->name < (char *)data+size);
+		for(uint32_t j=0; j<anim->num_frames; j++) {
+			CHECK(anim->frames[j].sprite_idx < data->image_count);
+		}
+	}
+	for(uint32_t i=0; i<data->image_count; i++) {
+		CHECK(data->images[i].sprite_idx < data->sprite_count);
+	}
+	free(data);
+	free(raw);
+}
+
+static void TestFindAnim(const char *path)
+{
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	ASPRData *data = sprite->data;
+	CHECK(data->anim_count == NUM_ANIM_NAMES);
+	for(uint32_t i=0; i<data->anim_count; i++) {
+		CHECK(AnimSpriteFindAnim(sprite, data->anims[i]->name) == (int)i);
+	}
+	for(size_t i=0; i<NUM_ANIM_NAMES; i++) {
+		int anim_idx = AnimSpriteFindAnim(sprite, anim_names[i]);
+		CHECK(anim_idx >= 0 && !strcmp(data->anims[anim_idx]->name, anim_names[i]));
+	}
+	static const char *missing[] = { "", "gro", "growing", "Grow", "idle" };
+	for(size_t i=0; i<sizeof(missing)/sizeof(missing[0]); i++) {
+		CHECK(AnimSpriteFindAnim(sprite, missing[i]) == -1);
+	}
+	// The table must keep an empty entry so failed lookups stop probing
+	uint32_t num_empty = 0;
+	for(uint32_t i=0; i<=data->anim_hash_mask; i++) {
+		num_empty += data->anim_hash[i] == 0xFFFF;
+	}
+	CHECK(num_empty > 0);
+	AnimSpriteDelete(sprite);
+}
+
+static void TestPlayback(const char *path)
+{
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	for(uint32_t i=0; i<sprite->data->anim_count; i++) {
+		ASPRAnim *anim = sprite->data->anims[i];
+		for(int loop=0; loop<2; loop++) {
+			AnimSpriteSetAnimIndex(sprite, i);
+			AnimSpriteSetLoop(sprite, loop);
+			AnimSpriteSetSpeed(sprite, 1.0f);
+			AnimSpriteSetTime(sprite, 0);
+			CHECK(sprite->frame_idx == 0);
+			for(uint32_t time=1; time<=anim->total_time*3; time++) {
+				AnimSpriteUpdate(sprite, 1.0f);
+				CHECK(sprite->frame_idx == ExpectedFrame(anim, time, loop));
+			}
+			if(!loop) {
+				CHECK(sprite->frame_idx == anim->num_frames-1);
+			}
+			for(uint32_t time=0; time<=anim->total_time+10; time++) {
+				AnimSpriteSetTime(sprite, time);
+				CHECK(sprite->frame_idx == ExpectedFrame(anim, time, loop));
+				if(!loop || time <= anim->total_time) {
+					CHECK(AnimSpriteGetTime(sprite) == (float)time);
+				}
+			}
+		}
+	}
+	AnimSpriteDelete(sprite);
+}
+
+static void TestLZ4(void)
+{
+	// Three literals then a match overlapping the bytes it produces
+	static const uint8_t match_block[] = { 0x35, 'a', 'b', 'c', 3, 0 };
+	uint8_t out[32];
+	DecompressLZ4(match_block, out, 12);
+	CHECK(!memcmp(out, "abcabcabcabc", 12));
+	// A literal run long enough to need an extra length byte
+	static const uint8_t literal_block[] = { 0xF0, 5, 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J',
+		'K', 'L', 'M', 'N', 'O', 'P', 'Q', 'R', 'S', 'T' };
+	DecompressLZ4(literal_block, out, 20);
+	CHECK(!memcmp(out, "ABCDEFGHIJKLMNOPQRST", 20));
+}
+
+// Returns the bytes of a sprite of a streamed sheet as stored in its .dat file
+static uint8_t *GetStoredSprite(ASPRData *data, uint8_t *dat, uint32_t image)
+{
+	return dat+data->stream_data->sprite_ofs[image];
+}
+
+static uint8_t *LoadDat(const char *path)
+{
+	char dat_path[strlen(path)+5];
+	sprintf(dat_path, "%s.dat", path);
+	return asset_load(dat_path, NULL);
+}
+
+// Plays every animation of a compressed sheet next to the same sheet stored
+// raw. Each shown sprite must match the raw one byte for byte.
+static void TestStreamSprites(const char *raw_path, const char *path)
+{
+	AnimSprite *ref = AnimSpriteLoad(raw_path);
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	uint8_t *dat = LoadDat(raw_path);
+	CHECK(ref->data->sprite_count == sprite->data->sprite_count);
+	CHECK(sprite->data->stream_data->comp_max_size != 0);
+	AnimSpriteResetPrefetchStats();
+	AnimSpriteDecompressStats decompress_start;
+	AnimSpriteGetDecompressStats(&decompress_start);
+	for(uint32_t i=0; i<sprite->data->anim_count; i++) {
+		AnimSpriteSetAnimIndex(sprite, i);
+		AnimSpriteSetLoop(sprite, true);
+		for(uint32_t time=0; time<sprite->data->anims[i]->total_time*2; time++) {
+			sprite_t *shown = AnimSpriteGetSprite(sprite);
+			uint32_t image = GetSpriteIdx(sprite);
+			CHECK(!memcmp(shown, GetStoredSprite(ref->data, dat, image), GetRawSize(ref->data, image)));
+			AnimSpriteUpdate(sprite, 1.0f);
+			AnimSpritePoolNextFrame();
+		}
+	}
+	AnimSpritePrefetchStats prefetch;
+	AnimSpriteGetPrefetchStats(&prefetch);
+	CHECK(prefetch.issued > 0);
+	CHECK(prefetch.used > 0);
+	CHECK(prefetch.used+prefetch.wasted <= prefetch.issued);
+	AnimSpriteDecompressStats decompress;
+	AnimSpriteGetDecompressStats(&decompress);
+	CHECK(decompress.frames > decompress_start.frames);
+	free(dat);
+	AnimSpriteDelete(sprite);
+	AnimSpriteDelete(ref);
+}
+
+// Rebuilds a frame of a delta encoded sheet from its keyframe and the delta
+// records in the .dat file
+static void BuildDeltaFrame(ASPRData *data, uint8_t *dat, int anim_idx, int frame, uint8_t *out)
+{
+	ASPRAnim *anim = data->anims[anim_idx];
+	ASPRDelta *deltas = data->anim_deltas[anim_idx];
+	int keyframe = frame;
+	while(deltas[keyframe].ofs != 0) {
+		keyframe--;
+	}
+	uint32_t image = data->images[anim->frames[keyframe].sprite_idx].sprite_idx;
+	memcpy(out, GetStoredSprite(data, dat, image), GetRawSize(data, image));
+	for(int i=keyframe+1; i<=frame; i++) {
+		uint32_t *record = (uint32_t *)(dat+deltas[i].ofs);
+		uint32_t num_spans = *record++;
+		for(uint32_t j=0; j<num_spans; j++) {
+			memcpy(out+record[0], &record[2], record[1]);
+			record += 2+((record[1]+3)/4);
+		}
+	}
+}
+
+static void TestDeltaSprites(const char *path)
+{
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	ASPRData *data = sprite->data;
+	uint8_t *dat = LoadDat(path);
+	uint8_t *expected = malloc(data->stream_data->spr_max_size);
+	CHECK(data->anim_deltas != NULL);
+	// Sprites only reached through delta records are not stored
+	uint32_t num_dropped = 0;
+	for(uint32_t i=0; i<data->sprite_count; i++) {
+		num_dropped += data->stream_data->sprite_ofs[i+1] == data->stream_data->sprite_ofs[i];
+	}
+	CHECK(num_dropped > 0);
+	for(uint32_t i=0; i<data->anim_count; i++) {
+		ASPRAnim *anim = data->anims[i];
+		AnimSpriteSetAnimIndex(sprite, i);
+		AnimSpriteSetLoop(sprite, true);
+		// Played in order, frames are patched from the previous one
+		for(uint32_t time=0; time<anim->total_time*2; time++) {
+			sprite_t *shown = AnimSpriteGetSprite(sprite);
+			BuildDeltaFrame(data, dat, i, sprite->frame_idx, expected);
+			CHECK(!memcmp(shown, expected, GetRawSize(data, GetSpriteIdx(sprite))));
+			AnimSpriteUpdate(sprite, 1.0f);
+			AnimSpritePoolNextFrame();
+		}
+		// Jumping to a frame rebuilds it from the keyframe before it
+		for(int frame=anim->num_frames-1; frame>=0; frame--) {
+			AnimSpriteSetTime(sprite, anim->frames[frame].time+1);
+			sprite_t *shown = AnimSpriteGetSprite(sprite);
+			BuildDeltaFrame(data, dat, i, frame, expected);
+			CHECK(sprite->frame_idx == frame);
+			CHECK(!memcmp(shown, expected, GetRawSize(data, GetSpriteIdx(sprite))));
+			AnimSpritePoolNextFrame();
+		}
+	}
+	free(expected);
+	free(dat);
+	AnimSpriteDelete(sprite);
+}
+
+static void TestPool(const char *path)
+{
+	AnimSpritePoolStats start, stats;
+	AnimSprite *a = AnimSpriteLoad(path);
+	AnimSprite *b = AnimSpriteLoad(path);
+	CHECK(a->sheet == b->sheet);
+	AnimSpriteGetPoolStats(&start);
+	// Sprites showing the same frame share its buffer
+	CHECK(AnimSpriteGetSprite(a) == AnimSpriteGetSprite(b));
+	AnimSpriteGetPoolStats(&stats);
+	CHECK(stats.shared == start.shared+1);
+	// Cached frames of a looping animation are not read again
+	AnimSpriteSetCacheBudget(64*1024);
+	int anim_idx = AnimSpriteFindAnim(a, "bounce");
+	AnimSpriteSetAnimIndex(a, anim_idx);
+	AnimSpriteSetLoop(a, true);
+	uint32_t total_time = a->data->anims[anim_idx]->total_time;
+	for(uint32_t time=0; time<total_time; time++) {
+		AnimSpriteGetSprite(a);
+		AnimSpriteUpdate(a, 1.0f);
+		AnimSpritePoolNextFrame();
+	}
+	AnimSpriteGetPoolStats(&start);
+	for(uint32_t time=0; time<total_time; time++) {
+		AnimSpriteGetSprite(a);
+		AnimSpriteUpdate(a, 1.0f);
+		AnimSpritePoolNextFrame();
+	}
+	AnimSpriteGetPoolStats(&stats);
+	CHECK(stats.misses == start.misses);
+	CHECK(stats.hits > start.hits);
+	// Without a cache only the shown frames stay in the budget
+	AnimSpriteSetCacheBudget(0);
+	// Each sprite holds its shown frame and one is read ahead
+	uint32_t budget = 3*a->data->stream_data->spr_max_size;
+	AnimSpriteSetPoolBudget(budget);
+	AnimSpriteGetPoolStats(&stats);
+	CHECK(stats.bytes <= budget);
+	AnimSpriteGetPoolStats(&start);
+	for(uint32_t time=0; time<total_time; time++) {
+		AnimSpriteGetSprite(a);
+		AnimSpriteUpdate(a, 1.0f);
+		AnimSpritePoolNextFrame();
+	}
+	AnimSpriteGetPoolStats(&stats);
+	CHECK(stats.over_budget == start.over_budget);
+	AnimSpriteSetPoolBudget(0);
+	AnimSpriteDelete(a);
+	AnimSpriteDelete(b);
+	// Buffers of a freed sheet are no longer found by its sprites
+	for(int i=0; i<stream_pool.num_slots; i++) {
+		CHECK(stream_pool.slots[i].refs == 0);
+		CHECK(!stream_pool.slots[i].buf || stream_pool.slots[i].sheet == NULL);
+	}
+}
+
+// Buffers are not reused until the RDP has drawn the frame they were released
+// in
+static void TestRdpSync(const char *path)
+{
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	AnimSpritePoolNextFrame();
+	host_rdp_stall(true);
+	bool loaded;
+	uint32_t size = sprite->data->stream_data->spr_max_size;
+	int first = PoolAcquire(sprite->data, 0, size, false, &loaded);
+	PoolRelease(first);
+	AnimSpritePoolNextFrame();
+	CHECK(!PoolSlotIdle(&stream_pool.slots[first]));
+	int second = PoolAcquire(sprite->data, 1, size, false, &loaded);
+	CHECK(second != first);
+	PoolRelease(second);
+	AnimSpritePoolNextFrame();
+	host_rdp_finish();
+	CHECK(PoolSlotIdle(&stream_pool.slots[first]));
+	CHECK(PoolSlotIdle(&stream_pool.slots[second]));
+	host_rdp_stall(false);
+	AnimSpriteDelete(sprite);
+}
+
+// Returns the size of a sprite of an embedded sheet. The sprite table ends
+// with a pointer to the end of the file.
+static uint32_t GetEmbeddedSize(ASPRData *data, uint32_t image)
+{
+	return (uint8_t *)data->sprite_data->sprite[image+1]-(uint8_t *)data->sprite_data->sprite[image];
+}
+
+// Plays every animation of a chunked sheet next to the embedded sheet. Each
+// shown sprite, from single sprites and group instances, must match the
+// embedded one byte for byte.
+static void TestChunkedSprites(const char *embed_path, const char *path)
+{
+	AnimSprite *ref = AnimSpriteLoad(embed_path);
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	AnimSpriteGroup *group = AnimSpriteGroupCreate(path, 1);
+	CHECK(sprite->data->chunks != NULL);
+	CHECK(ref->data->sprite_count == sprite->data->sprite_count);
+	AnimSpriteGroupAdd(group, 0, true);
+	for(uint32_t i=0; i<sprite->data->anim_count; i++) {
+		AnimSpriteSetAnimIndex(ref, i);
+		AnimSpriteSetAnimIndex(sprite, i);
+		AnimSpriteGroupSetAnim(group, 0, i);
+		AnimSpriteSetLoop(ref, true);
+		AnimSpriteSetLoop(sprite, true);
+		for(uint32_t time=0; time<sprite->data->anims[i]->total_time*2; time++) {
+			sprite_t *expected = AnimSpriteGetSprite(ref);
+			uint32_t size = GetEmbeddedSize(ref->data, GetSpriteIdx(ref));
+			CHECK(!memcmp(AnimSpriteGetSprite(sprite), expected, size));
+			CHECK(!memcmp(AnimSpriteGroupGetSprite(group, 0), expected, size));
+			AnimSpriteUpdate(ref, 1.0f);
+			AnimSpriteUpdate(sprite, 1.0f);
+			AnimSpriteGroupUpdate(group, 1.0f);
+			AnimSpritePoolNextFrame();
+		}
+	}
+	AnimSpriteGroupDelete(group);
+	AnimSpriteDelete(sprite);
+	AnimSpriteDelete(ref);
+}
+
+// Checks which animations of a chunked sheet stay loaded as sprites and group
+// instances show them, the game preloads and unloads them and chunks are
+// evicted
+static void TestChunkResidency(const char *path)
+{
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	int num_anims = sprite->data->anim_count;
+	CHECK(num_anims >= 5);
+	for(int i=0; i<num_anims; i++) {
+		CHECK(!AnimSpriteIsAnimLoaded(sprite, i));
+	}
+	// Drawing loads the first animation and setting one loads it
+	AnimSpriteGetSprite(sprite);
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 0));
+	AnimSpriteSetAnimIndex(sprite, 2);
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 2));
+	// The animation released this frame may still be drawn
+	AnimSpriteEvictAnims();
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 0));
+	AnimSpritePoolNextFrame();
+	AnimSpriteEvictAnims();
+	CHECK(!AnimSpriteIsAnimLoaded(sprite, 0));
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 2));
+	// Preloaded animations survive eviction until they are unloaded
+	static const int preload[] = { 1, 3 };
+	AnimSpritePreloadAnims(sprite, preload, 2);
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 1) && AnimSpriteIsAnimLoaded(sprite, 3));
+	AnimSpritePoolNextFrame();
+	AnimSpriteEvictAnims();
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 1) && AnimSpriteIsAnimLoaded(sprite, 3));
+	AnimSpriteUnloadAnims(sprite, preload, 1);
+	CHECK(!AnimSpriteIsAnimLoaded(sprite, 1) && AnimSpriteIsAnimLoaded(sprite, 3));
+	// Unloading a shown animation keeps it until it is no longer shown
+	AnimSpriteSetAnimIndex(sprite, 3);
+	AnimSpriteUnloadAnims(sprite, &preload[1], 1);
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 3));
+	// Chunks are kept until the RDP has drawn the frame they were released in
+	host_rdp_stall(true);
+	AnimSpriteSetAnimIndex(sprite, 4);
+	AnimSpritePoolNextFrame();
+	AnimSpriteEvictAnims();
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 3));
+	host_rdp_finish();
+	AnimSpriteEvictAnims();
+	CHECK(!AnimSpriteIsAnimLoaded(sprite, 3));
+	host_rdp_stall(false);
+	// Group instances hold the chunks of their animations
+	AnimSpriteGroup *group = AnimSpriteGroupCreate(path, 2);
+	CHECK(group->sheet == sprite->sheet);
+	AnimSpriteGroupAdd(group, 1, true);
+	AnimSpriteGroupAdd(group, 2, true);
+	AnimSpritePoolNextFrame();
+	AnimSpriteEvictAnims();
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 1) && AnimSpriteIsAnimLoaded(sprite, 2));
+	AnimSpriteGroupSetAnim(group, 0, 0);
+	AnimSpriteGroupRemove(group, 1);
+	AnimSpritePoolNextFrame();
+	AnimSpriteEvictAnims();
+	CHECK(AnimSpriteIsAnimLoaded(sprite, 0));
+	CHECK(!AnimSpriteIsAnimLoaded(sprite, 1) && !AnimSpriteIsAnimLoaded(sprite, 2));
+	AnimSpriteGroupDelete(group);
+	AnimSpritePoolNextFrame();
+	AnimSpriteEvictAnims();
+	CHECK(!AnimSpriteIsAnimLoaded(sprite, 0) && AnimSpriteIsAnimLoaded(sprite, 4));
+	AnimSpriteDelete(sprite);
+}
+
+static const float group_speeds[] = { 0.0f, 0.5f, 1.0f, 1.3f, 2.5f };
+
+#define NUM_GROUP_SPEEDS (sizeof(group_speeds)/sizeof(group_speeds[0]))
+#define NUM_GROUP_UPDATES 400
+#define GROUP_SWITCH_UPDATE 150
+
+// Checks that the changed list holds each instance at most once and exactly
+// those in expected
+static void CheckChanged(AnimSpriteGroup *group, int num_changed, const bool *expected)
+{
+	bool seen[group->count];
+	memset(seen, 0, sizeof(seen));
+	const uint16_t *changed = AnimSpriteGroupGetChanged(group);
+	CHECK(num_changed == AnimSpriteGroupGetNumChanged(group));
+	for(int i=0; i<num_changed; i++) {
+		CHECK(changed[i] < group->count && !seen[changed[i]]);
+		if(changed[i] < group->count) {
+			seen[changed[i]] = true;
+		}
+	}
+	for(int i=0; i<group->count; i++) {
+		CHECK(seen[i] == expected[i]);
+	}
+}
+
+// Plays the same animations, speeds and loop flags in a group and in single
+// sprites. Both must show the same frames and the group must report every
+// instance whose frame changed or whose animation was set.
+static void TestGroup(const char *path)
+{
+	AnimSpriteGroup *group = AnimSpriteGroupCreate(path, 64);
+	int num_anims = group->sheet->data->anim_count;
+	int num_instances = num_anims*NUM_GROUP_SPEEDS*2;
+	AnimSprite *sprites[num_instances];
+	for(int i=0; i<num_instances; i++) {
+		int anim_idx = i % num_anims;
+		float speed = group_speeds[(i/num_anims) % NUM_GROUP_SPEEDS];
+		bool loop = i/(num_anims*NUM_GROUP_SPEEDS);
+		CHECK(AnimSpriteGroupAdd(group, anim_idx, loop) == i);
+		AnimSpriteGroupSetSpeed(group, i, speed);
+		sprites[i] = AnimSpriteLoad(path);
+		AnimSpriteSetAnimIndex(sprites[i], anim_idx);
+		AnimSpriteSetLoop(sprites[i], loop);
+		AnimSpriteSetSpeed(sprites[i], speed);
+	}
+	bool expected[num_instances];
+	// Added instances are reported by the first update
+	for(int i=0; i<num_instances; i++) {
+		expected[i] = true;
+	}
+	for(int update=0; update<NUM_GROUP_UPDATES; update++) {
+		int prev_frame[num_instances];
+		for(int i=0; i<num_instances; i++) {
+			prev_frame[i] = group->frame_idx[i];
+			if(update == GROUP_SWITCH_UPDATE && i % 3 == 0) {
+				int anim_idx = (group->anim_idx[i]+1) % num_anims;
+				AnimSpriteGroupSetAnim(group, i, anim_idx);
+				AnimSpriteSetAnimIndex(sprites[i], anim_idx);
+				AnimSpriteSetTime(sprites[i], 0);
+				expected[i] = true;
+			}
+			AnimSpriteUpdate(sprites[i], 1.0f);
+		}
+		int num_changed = AnimSpriteGroupUpdate(group, 1.0f);
+		bool match = true;
+		for(int i=0; i<num_instances; i++) {
+			match = match && group->frame_idx[i] == sprites[i]->frame_idx && group->anim_idx[i] == sprites[i]->anim_idx;
+			expected[i] = expected[i] || group->frame_idx[i] != prev_frame[i];
+		}
+		CHECK(match);
+		CheckChanged(group, num_changed, expected);
+		memset(expected, 0, sizeof(expected));
+	}
+	// Instances set to an animation that stays on frame 0 are reported
+	for(int i=0; i<num_instances; i++) {
+		AnimSpriteGroupSetAnim(group, i, group->anim_idx[i]);
+		AnimSpriteGroupSetSpeed(group, i, 0.01f);
+		expected[i] = true;
+	}
+	CheckChanged(group, AnimSpriteGroupUpdate(group, 1.0f), expected);
+	for(int i=0; i<num_instances; i++) {
+		CHECK(group->frame_idx[i] == 0);
+		expected[i] = false;
+	}
+	CheckChanged(group, AnimSpriteGroupUpdate(group, 1.0f), expected);
+	for(int i=0; i<num_instances; i++) {
+		AnimSpriteDelete(sprites[i]);
+	}
+	AnimSpriteGroupDelete(group);
+}
+
+// Removing an instance moves the last one into its place along with its
+// playback state and its entry in the changed list
+static void TestGroupRemove(const char *path)
+{
+	AnimSpriteGroup *group = AnimSpriteGroupCreate(path, 4);
+	for(int i=0; i<4; i++) {
+		AnimSpriteGroupAdd(group, i, i & 1);
+		AnimSpriteGroupSetSpeed(group, i, 0.5f+i);
+	}
+	for(int i=0; i<10; i++) {
+		AnimSpriteGroupUpdate(group, 1.0f);
+	}
+	AnimSpriteGroupSetAnim(group, 1, 4);
+	AnimSpriteGroupSetAnim(group, 3, 0);
+	AnimSpriteGroupUpdate(group, 1.0f);
+	CHECK(AnimSpriteGroupGetNumChanged(group) >= 2);
+	bool was_changed[4] = { false };
+	for(int i=0; i<AnimSpriteGroupGetNumChanged(group); i++) {
+		was_changed[AnimSpriteGroupGetChanged(group)[i]] = true;
+	}
+	AnimSpriteGroupGetSprite(group, 3);
+	AnimTime time = group->time[3];
+	AnimTime speed = group->speed[3];
+	int anim_idx = group->anim_idx[3];
+	int frame_idx = group->frame_idx[3];
+	bool loop = group->loop[3];
+	int slot = group->slot[3];
+	CHECK(AnimSpriteGroupRemove(group, 1) == 3);
+	CHECK(group->count == 3);
+	CHECK(group->time[1] == time && group->speed[1] == speed && group->loop[1] == loop);
+	CHECK(group->anim_idx[1] == anim_idx && group->frame_idx[1] == frame_idx && group->slot[1] == slot);
+	bool expected[3] = { was_changed[0], was_changed[3], was_changed[2] };
+	CheckChanged(group, AnimSpriteGroupGetNumChanged(group), expected);
+	// Removing the last instance moves nothing
+	CHECK(AnimSpriteGroupRemove(group, 2) == -1);
+	CHECK(group->count == 2);
+	CHECK(group->anim_idx[1] == anim_idx && group->frame_idx[1] == frame_idx);
+	AnimSpriteGroupDelete(group);
+}
+
+// Speeds the float and fixed point builds are compared at
+static const float time_speeds[] = { 0.1f, 0.25f, 0.3f, 0.5f, 0.7f, 0.75f, 0.9f, 1.0f, 1.1f, 1.25f, 1.3f, 1.5f, 2.0f, 2.2f, 3.0f };
+
+#define NUM_TIME_SPEEDS (sizeof(time_speeds)/sizeof(time_speeds[0]))
+#define NUM_TIME_UPDATES 600
+
+#ifdef ANIMSPRITE_FIXED_TIME
+// Speeds that are multiples of 1/256 add up without rounding in both builds
+static bool IsExactSpeed(float speed)
+{
+	return speed*256.0f == floorf(speed*256.0f);
+}
+#endif
+
+// Plays every animation at every test speed and returns the frame shown after
+// each update, looping and not. Each run has one update past the checked ones
+// so the last checked update can be compared with the float build's next.
+#define TIME_RUN_LENGTH (NUM_TIME_UPDATES+1)
+
+static uint8_t *PlayTimeRuns(const char *path, size_t *size)
+{
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	uint32_t num_anims = sprite->data->anim_count;
+	*size = num_anims*NUM_TIME_SPEEDS*2*TIME_RUN_LENGTH;
+	uint8_t *frames = malloc(*size);
+	uint8_t *out = frames;
+	for(uint32_t i=0; i<num_anims; i++) {
+		for(size_t j=0; j<NUM_TIME_SPEEDS; j++) {
+			for(int loop=0; loop<2; loop++) {
+				AnimSpriteSetAnimIndex(sprite, i);
+				AnimSpriteSetLoop(sprite, loop);
+				AnimSpriteSetSpeed(sprite, time_speeds[j]);
+				AnimSpriteSetTime(sprite, 0);
+				for(int k=0; k<TIME_RUN_LENGTH; k++) {
+					AnimSpriteUpdate(sprite, 1.0f);
+					*out++ = sprite->frame_idx;
+				}
+			}
+		}
+	}
+	AnimSpriteDelete(sprite);
+	return frames;
+}
+
+// The float build writes the frames it shows to frames_path and the fixed
+// point build checks its own against them. At exact speeds both must match.
+// Other speeds round differently and a frame may change one update early or
+// late.
+static void TestTimeBuilds(const char *path, const char *frames_path)
+{
+	// Speed 0.3 truncated to 16.16 reached frame 1 of grow an update late
+	AnimSprite *sprite = AnimSpriteLoad(path);
+	AnimSpriteSetAnim(sprite, "grow");
+	AnimSpriteSetSpeed(sprite, 0.3f);
+	int first_change = 0;
+	while(sprite->frame_idx == 0 && first_change < NUM_TIME_UPDATES) {
+		AnimSpriteUpdate(sprite, 1.0f);
+		first_change++;
+	}
+	CHECK(first_change == 20);
+	AnimSpriteDelete(sprite);
+
+	size_t size;
+	uint8_t *frames = PlayTimeRuns(path, &size);
+#ifdef ANIMSPRITE_FIXED_TIME
+	FILE *file = fopen(frames_path, "rb");
+	CHECK(file != NULL);
+	if(!file) {
+		free(frames);
+		return;
+	}
+	uint8_t *float_frames = malloc(size);
+	CHECK(fread(float_frames, 1, size, file) == size && fgetc(file) == EOF);
+	fclose(file);
+	size_t run = 0;
+	for(size_t ofs=0; ofs<size; ofs+=TIME_RUN_LENGTH, run++) {
+		float speed = time_speeds[(run/2) % NUM_TIME_SPEEDS];
+		const uint8_t *expected = float_frames+ofs;
+		const uint8_t *shown = frames+ofs;
+		bool match = true;
+		for(int i=0; i<NUM_TIME_UPDATES; i++) {
+			if(IsExactSpeed(speed)) {
+				match = match && shown[i] == expected[i];
+			} else {
+				bool near = shown[i] == expected[i] || (i > 0 && shown[i] == expected[i-1])
+					|| (i+1 < TIME_RUN_LENGTH && shown[i] == expected[i+1]);
+				match = match && near;
+			}
+		}
+		if(!match) {
+			fprintf(stderr, "Fixed point frames differ at speed %.2f in run %zu\n", speed, run);
+		}
+		CHECK(match);
+	}
+	free(float_frames);
+#else
+	FILE *file = fopen(frames_path, "wb");
+	CHECK(file && fwrite(frames, 1, size, file) == size && fclose(file) == 0);
+#endif
+	free(frames);
+}
+
+int main(int argc, char **argv)
+{
+	const char *frames_path = NULL;
+	int i;
+	for(i=1; i+1<argc; i+=2) {
+		if(!strcmp(argv[i], "-d")) {
+			host_set_rom_dir(argv[i+1]);
+		} else if(!strcmp(argv[i], "-t")) {
+			frames_path = argv[i+1];
+		} else {
+			break;
+		}
+	}
+	if(i != argc) {
+		fprintf(stderr, "Usage: %s -d <rom dir> [-t <frame file>]\n", argv[0]);
+		return 1;
+	}
+	TestRelocation(SHEET_EMBED);
+	TestRelocation(SHEET_COMPRESS);
+	TestRelocation(SHEET_DELTA);
+	TestFindAnim(SHEET_EMBED);
+	TestPlayback(SHEET_EMBED);
+	TestPlayback(SHEET_COMPRESS);
+	TestLZ4();
+	TestStreamSprites(SHEET_STREAM, SHEET_COMPRESS);
+	TestDeltaSprites(SHEET_DELTA);
+	TestPool(SHEET_STREAM);
+	TestRdpSync(SHEET_STREAM);
+	TestGroup(SHEET_EMBED);
+	TestGroup(SHEET_STREAM);
+	TestGroupRemove(SHEET_EMBED);
+	TestChunkedSprites(SHEET_EMBED, SHEET_CHUNKED);
+	TestChunkResidency(SHEET_CHUNKED);
+	TestGroup(SHEET_CHUNKED);
+	if(frames_path) {
+		TestTimeBuilds(SHEET_EMBED, frames_path);
+	}
+	printf("%d checks, %d failed\n", num_checks, num_failed);
+	return num_failed != 0;
+}
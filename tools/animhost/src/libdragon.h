@@ -0,0 +1,61 @@
+#ifndef ANIMHOST_LIBDRAGON_H
+#define ANIMHOST_LIBDRAGON_H
+
+// Stand-in for the parts of libdragon used by animsprite.c so the runtime can
+// be built and profiled on the host. Files under rom:/ are read from the
+// directory passed to host_set_rom_dir and DMA is a plain copy.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <assert.h>
+
+typedef struct sprite_s {
+	uint16_t width;
+	uint16_t height;
+	uint8_t flags;
+	uint8_t hslices;
+	uint8_t vslices;
+} sprite_t;
+
+#define assertf(expr, ...) do { \
+	if(!(expr)) { \
+		fprintf(stderr, "ASSERTION FAILED: %s\n", #expr); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		abort(); \
+	} \
+} while(0)
+
+#define TICKS_PER_SECOND (93750000/2)
+#define TICKS_READ() host_ticks_read()
+#define TICKS_DISTANCE(from, to) ((int32_t)((uint32_t)(to) - (uint32_t)(from)))
+
+void host_set_rom_dir(const char *dir);
+uint32_t host_ticks_read(void);
+// Drawing finishes at once unless the RDP is stalled, which keeps
+// rdpq_sync_full callbacks pending until host_rdp_finish
+void host_rdp_stall(bool stall);
+void host_rdp_finish(void);
+// Bytes passed to data_cache_hit_writeback so far
+uint32_t host_writeback_bytes(void);
+
+void *asset_load(const char *fn, int *sz);
+uint32_t dfs_rom_addr(const char *path);
+void dma_read(void *ram_address, unsigned long pi_address, unsigned long len);
+void dma_read_async(void *ram_address, unsigned long pi_address, unsigned long len);
+void dma_wait(void);
+volatile int dma_busy(void);
+uint32_t io_read(uint32_t pi_address);
+void data_cache_hit_writeback(volatile const void *addr, unsigned long length);
+void data_cache_hit_writeback_invalidate(volatile void *addr, unsigned long length);
+void data_cache_hit_invalidate(volatile void *addr, unsigned long length);
+void *malloc_uncached(size_t size);
+void free_uncached(void *buf);
+void rdpq_sync_full(void (*callback)(void *), void *arg);
+
+#endif
@@ -0,0 +1,193 @@
+#include "libdragon.h"
+#include <time.h>
+
+// Files given a ROM address by dfs_rom_addr, laid out one after another like
+// the DFS image in the cartridge
+typedef struct rom_file {
+	char *path;
+	uint8_t *data;
+	uint32_t addr;
+	uint32_t size;
+} RomFile;
+
+#define ROM_BASE 0x10000000
+
+static const char *rom_dir = ".";
+static RomFile *rom_files;
+static int num_rom_files;
+static uint32_t rom_end = ROM_BASE;
+
+void host_set_rom_dir(const char *dir)
+{
+	rom_dir = dir;
+}
+
+uint32_t host_ticks_read(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t ns = (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+	return ns*(TICKS_PER_SECOND/1000)/1000000;
+}
+
+static uint8_t *ReadHostFile(const char *path, uint32_t *size)
+{
+	// Paths are the same as on the N64 with or without the rom:/ prefix
+	if(!strncmp(path, "rom:/", 5)) {
+		path += 5;
+	}
+	while(*path == '/') {
+		path++;
+	}
+	char full_path[strlen(rom_dir)+strlen(path)+2];
+	sprintf(full_path, "%s/%s", rom_dir, path);
+	FILE *file = fopen(full_path, "rb");
+	if(!file) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	// Aligned like asset_load so relocated structures can be used in place
+	uint8_t *data = memalign(16, *size);
+	if(fread(data, 1, *size, file) != *size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	return data;
+}
+
+void *asset_load(const char *fn, int *sz)
+{
+	uint32_t size;
+	void *data = ReadHostFile(fn, &size);
+	assertf(data, "File %s not found in %s", fn, rom_dir);
+	if(sz) {
+		*sz = size;
+	}
+	return data;
+}
+
+uint32_t dfs_rom_addr(const char *path)
+{
+	for(int i=0; i<num_rom_files; i++) {
+		if(!strcmp(rom_files[i].path, path)) {
+			return rom_files[i].addr;
+		}
+	}
+	uint32_t size;
+	uint8_t *data = ReadHostFile(path, &size);
+	if(!data) {
+		return 0;
+	}
+	rom_files = realloc(rom_files, (num_rom_files+1)*sizeof(RomFile));
+	RomFile *file = &rom_files[num_rom_files++];
+	file->path = strdup(path);
+	file->data = data;
+	file->addr = rom_end;
+	file->size = size;
+	rom_end += (size+1) & ~1;
+	return file->addr;
+}
+
+void dma_read(void *ram_address, unsigned long pi_address, unsigned long len)
+{
+	for(int i=0; i<num_rom_files; i++) {
+		RomFile *file = &rom_files[i];
+		if(pi_address >= file->addr && pi_address-file->addr < file->size) {
+			assertf(pi_address-file->addr+len <= file->size, "DMA past the end of %s", file->path);
+			memcpy(ram_address, file->data+(pi_address-file->addr), len);
+			return;
+		}
+	}
+	assertf(0, "DMA from unmapped ROM address %08lx", pi_address);
+}
+
+uint32_t io_read(uint32_t pi_address)
+{
+	uint8_t word[4];
+	dma_read(word, pi_address, 4);
+	return (word[0] << 24) | (word[1] << 16) | (word[2] << 8) | word[3];
+}
+
+void dma_read_async(void *ram_address, unsigned long pi_address, unsigned long len)
+{
+	dma_read(ram_address, pi_address, len);
+}
+
+void dma_wait(void)
+{
+}
+
+volatile int dma_busy(void)
+{
+	return 0;
+}
+
+static uint32_t writeback_bytes;
+
+uint32_t host_writeback_bytes(void)
+{
+	return writeback_bytes;
+}
+
+void data_cache_hit_writeback(volatile const void *addr, unsigned long length)
+{
+	writeback_bytes += length;
+}
+
+void data_cache_hit_writeback_invalidate(volatile void *addr, unsigned long length)
+{
+}
+
+void data_cache_hit_invalidate(volatile void *addr, unsigned long length)
+{
+}
+
+void *malloc_uncached(size_t size)
+{
+	return memalign(16, size);
+}
+
+void free_uncached(void *buf)
+{
+	free(buf);
+}
+
+#define MAX_RDP_CALLBACKS 16
+
+static bool rdp_stalled;
+static int num_rdp_callbacks;
+static struct {
+	void (*callback)(void *);
+	void *arg;
+} rdp_callbacks[MAX_RDP_CALLBACKS];
+
+void host_rdp_stall(bool stall)
+{
+	rdp_stalled = stall;
+	if(!stall) {
+		host_rdp_finish();
+	}
+}
+
+void host_rdp_finish(void)
+{
+	for(int i=0; i<num_rdp_callbacks; i++) {
+		rdp_callbacks[i].callback(rdp_callbacks[i].arg);
+	}
+	num_rdp_callbacks = 0;
+}
+
+void rdpq_sync_full(void (*callback)(void *), void *arg)
+{
+	if(!rdp_stalled) {
+		callback(arg);
+		return;
+	}
+	assertf(num_rdp_callbacks < MAX_RDP_CALLBACKS, "Too many pending RDP syncs");
+	rdp_callbacks[num_rdp_callbacks].callback = callback;
+	rdp_callbacks[num_rdp_callbacks].arg = arg;
+	num_rdp_callbacks++;
+}
@@ -0,0 +1,70 @@
+#include <algorithm>
+
+#include "atlas.h"
+
+struct AtlasShelf {
+	int page;
+	int y;
+	int height;
+	int x;
+};
+
+// Shelf packer: items are placed tallest first, left to right on shelves.
+// A new shelf opens below the last one and a new page when that runs out.
+// Items larger than a page get a page of their own.
+void atlas_pack(std::vector<AtlasItem> &items, std::vector<AtlasPage> &pages, int max_width, int max_height, int align_x)
+{
+	std::vector<size_t> order(items.size());
+	for(size_t i=0; i<items.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		if(items[a].height != items[b].height) {
+			return items[a].height > items[b].height;
+		}
+		return items[a].width > items[b].width;
+	});
+	std::vector<AtlasShelf> shelves;
+	std::vector<int> page_bottom;
+	size_t first_page = pages.size();
+	for(size_t i=0; i<order.size(); i++) {
+		AtlasItem &item = items[order[i]];
+		int width = (item.width+align_x-1)/align_x*align_x;
+		if(width > max_width || item.height > max_height) {
+			item.page = pages.size();
+			item.x = item.y = 0;
+			pages.push_back({ item.width, item.height });
+			page_bottom.push_back(max_height);
+			continue;
+		}
+		AtlasShelf *shelf = NULL;
+		for(size_t j=0; j<shelves.size(); j++) {
+			if(item.height <= shelves[j].height && shelves[j].x+width <= max_width) {
+				shelf = &shelves[j];
+				break;
+			}
+		}
+		if(!shelf) {
+			size_t page;
+			for(page=0; page<page_bottom.size(); page++) {
+				if(page_bottom[page]+item.height <= max_height) {
+					break;
+				}
+			}
+			if(page == page_bottom.size()) {
+				pages.push_back({ 0, 0 });
+				page_bottom.push_back(0);
+			}
+			shelves.push_back({ (int)(first_page+page), page_bottom[page], item.height, 0 });
+			page_bottom[page] += item.height;
+			shelf = &shelves.back();
+		}
+		item.page = shelf->page;
+		item.x = shelf->x;
+		item.y = shelf->y;
+		shelf->x += width;
+		AtlasPage &page = pages[item.page];
+		page.width = std::max(page.width, item.x+item.width);
+		page.height = std::max(page.height, item.y+item.height);
+	}
+}
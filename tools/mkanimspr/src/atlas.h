@@ -0,0 +1,21 @@
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <vector>
+
+struct AtlasItem {
+	int width = 0;
+	int height = 0;
+	int page = -1;
+	int x = 0;
+	int y = 0;
+};
+
+struct AtlasPage {
+	int width = 0;
+	int height = 0;
+};
+
+void atlas_pack(std::vector<AtlasItem> &items, std::vector<AtlasPage> &pages, int max_width, int max_height, int align_x);
+
+#endif
@@ -0,0 +1,142 @@
+#include "spriteenc.h"
+
+#include <string>
+#include <filesystem>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+namespace fs = std::filesystem;
+
+// Writes synthetic .spranm sheets of 10, 100 and 1000 frames for timing
+// mkanimspr, and bench.manifest to convert each of them with every layout.
+// The output is always the same so runs on different builds convert the same
+// input.
+
+struct FrameStyle {
+	const char *format;
+	int width;
+	int height;
+};
+
+// Every frame gets the next style so each sheet mixes formats and sizes
+static const FrameStyle frame_styles[] = {
+	{ "RGBA16", 32, 32 },
+	{ "CI8", 64, 32 },
+	{ "RGBA32", 16, 16 },
+	{ "CI4", 32, 32 },
+	{ "IA8", 64, 64 },
+	{ "I8", 96, 16 },
+	{ "RGBA16", 64, 64 },
+};
+
+#define NUM_FRAME_STYLES (sizeof(frame_styles)/sizeof(frame_styles[0]))
+#define FRAMES_PER_ANIM 10
+
+static const int sheet_sizes[] = { 10, 100, 1000 };
+
+struct SheetLayout {
+	const char *name;
+	const char *flags;
+};
+
+static const SheetLayout sheet_layouts[] = {
+	{ "embed", "" },
+	{ "stream", "--stream --compress" },
+	{ "atlas", "--atlas --trim" },
+};
+
+static void die(const char *fmt, const char *arg)
+{
+	fprintf(stderr, fmt, arg);
+	exit(1);
+}
+
+static void WriteText(const fs::path &path, const std::string &text)
+{
+	FILE *file = fopen(path.string().c_str(), "wb");
+	if(!file || fwrite(text.data(), 1, text.size(), file) != text.size() || fclose(file) != 0) {
+		die("Failed to write %s\n", path.string().c_str());
+	}
+}
+
+// A blob moving over a gradient, different for every frame so none are merged
+static void DrawFrame(SpriteImage &image, const FrameStyle &style, int frame)
+{
+	image.width = style.width;
+	image.height = style.height;
+	image.alpha = true;
+	image.color = true;
+	image.pixels.resize(image.width*image.height*4);
+	float cx = image.width*(0.5f+0.4f*sinf(frame*0.37f));
+	float cy = image.height*(0.5f+0.4f*cosf(frame*0.23f));
+	float radius = std::min(image.width, image.height)*0.3f;
+	for(int y=0; y<image.height; y++) {
+		for(int x=0; x<image.width; x++) {
+			uint8_t *px = &image.pixels[(y*image.width+x)*4];
+			float dist = hypotf(x-cx, y-cy);
+			px[0] = (x*255)/image.width;
+			px[1] = (y*255)/image.height;
+			px[2] = (frame*37) & 0xFF;
+			px[3] = dist < radius ? 255 : (dist < radius*1.5f ? 128 : 0);
+		}
+	}
+}
+
+static void WriteSheet(const fs::path &dir, int num_frames)
+{
+	std::string name = "bench_" + std::to_string(num_frames);
+	fs::path image_dir = dir / name;
+	fs::create_directories(image_dir);
+	std::string anims;
+	std::string images;
+	for(int i=0; i<num_frames; i++) {
+		const FrameStyle &style = frame_styles[i % NUM_FRAME_STYLES];
+		std::string id = "frame_" + std::to_string(i);
+		SpriteImage image;
+		DrawFrame(image, style, i);
+		std::vector<uint8_t> png;
+		std::string error;
+		if(!spriteenc_save_png(png, image, error)) {
+			die("Failed to encode PNG: %s\n", error.c_str());
+		}
+		WriteText(image_dir / (id + ".png"), std::string(png.begin(), png.end()));
+		if(i % FRAMES_PER_ANIM == 0) {
+			if(i != 0) {
+				anims += "\t\t</animation>\n";
+			}
+			anims += "\t\t<animation name=\"anim_" + std::to_string(i/FRAMES_PER_ANIM) + "\" delay=\"6\">\n";
+		}
+		anims += "\t\t\t<frame image=\"" + id + "\"/>\n";
+		images += "\t\t<image filename=\"" + name + "/" + id + ".png\" id=\"" + id + "\" format=\"" + style.format + "\"/>\n";
+	}
+	anims += "\t\t</animation>\n";
+	std::string text = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<animsprite>\n";
+	text += "\t<animations>\n" + anims + "\t</animations>\n";
+	text += "\t<images>\n" + images + "\t</images>\n";
+	text += "</animsprite>\n";
+	WriteText(dir / (name + ".spranm"), text);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 2) {
+		fprintf(stderr, "Usage: %s <output directory>\n", argv[0]);
+		return 1;
+	}
+	fs::path dir = argv[1];
+	fs::create_directories(dir / "out");
+	std::string manifest;
+	for(size_t i=0; i<sizeof(sheet_sizes)/sizeof(sheet_sizes[0]); i++) {
+		WriteSheet(dir, sheet_sizes[i]);
+		std::string name = "bench_" + std::to_string(sheet_sizes[i]);
+		for(size_t j=0; j<sizeof(sheet_layouts)/sizeof(sheet_layouts[0]); j++) {
+			manifest += (dir / (name + ".spranm")).string() + " ";
+			manifest += (dir / "out" / (name + "_" + sheet_layouts[j].name + ".aspr")).string() + " ";
+			manifest += std::string(sheet_layouts[j].flags) + "\n";
+		}
+	}
+	WriteText(dir / "bench.manifest", manifest);
+	return 0;
+}
@@ -1,108 +1,153 @@
-#include <unordered_map>
-#include <vector>
+#include <filesystem>
+#include <utility>
+#include <string.h>
 
 #include "binwrite.h"
 
-struct FileSymbolRef {
-	FILE *file = NULL;
-	int offset = -1;
-};
+namespace fs = std::filesystem;
 
-struct FileSymbol {
-	int value = -1;
-	std::vector<FileSymbolRef> pending_refs = {};
-};
-
-static std::unordered_map<std::string, FileSymbol> file_symbols;
+static void binwrite_u32_at(BinWriter *writer, int pos, uint32_t value)
+{
+	if(writer->little_endian) {
+		writer->data[pos] = value & 0xff;
+		writer->data[pos+1] = (value >> 8) & 0xff;
+		writer->data[pos+2] = (value >> 16) & 0xff;
+		writer->data[pos+3] = value >> 24;
+	} else {
+		writer->data[pos] = value >> 24;
+		writer->data[pos+1] = (value >> 16) & 0xff;
+		writer->data[pos+2] = (value >> 8) & 0xff;
+		writer->data[pos+3] = value & 0xff;
+	}
+}
 
-void binwrite_u8(FILE *file, uint8_t value)
+void binwrite_u8(BinWriter *writer, uint8_t value)
 {
-	fputc(value, file);
+	writer->data.push_back(value);
 }
 
-void binwrite_u16(FILE *file, uint16_t value)
+void binwrite_u16(BinWriter *writer, uint16_t value)
 {
-    binwrite_u8(file, value >> 8);
-    binwrite_u8(file, value & 0xff);
+	uint8_t bytes[2] = { (uint8_t)(value >> 8), (uint8_t)(value & 0xff) };
+	if(writer->little_endian) {
+		std::swap(bytes[0], bytes[1]);
+	}
+	writer->data.insert(writer->data.end(), bytes, bytes+2);
 }
 
-void binwrite_u32(FILE *file, uint32_t value)
+void binwrite_u32(BinWriter *writer, uint32_t value)
 {
-    binwrite_u16(file, value >> 16);
-    binwrite_u16(file, value & 0xffff);
+	writer->data.insert(writer->data.end(), 4, 0);
+	binwrite_u32_at(writer, writer->data.size()-4, value);
 }
 
-void binwrite_string(FILE *file, const char *string)
+void binwrite_string(BinWriter *writer, const char *string)
 {
-	while(*string) {
-		char c = *string++;
-		binwrite_u8(file, c);
-	}
-	binwrite_u8(file, 0);
+	binwrite_data(writer, string, strlen(string)+1);
 }
 
-void binwrite_u32_at(FILE *file, int pos, uint32_t value)
+void binwrite_data(BinWriter *writer, const void *data, size_t size)
 {
-    int cur = ftell(file);
-    fseek(file, pos, SEEK_SET);
-    binwrite_u32(file, value);
-    fseek(file, cur, SEEK_SET);
+	const uint8_t *bytes = (const uint8_t *)data;
+	writer->data.insert(writer->data.end(), bytes, bytes+size);
 }
 
-void binwrite_align(FILE *file, int align)
-{ 
-    int pos = ftell(file);
-    while (pos++ % align) binwrite_u8(file, 0);
+void binwrite_align(BinWriter *writer, int align)
+{
+	size_t pos = writer->data.size();
+	if(pos % align) {
+		writer->padding += align-(pos % align);
+		binwrite_pad(writer, align-(pos % align));
+	}
 }
 
-void binwrite_pad(FILE *file, int size)
+void binwrite_pad(BinWriter *writer, int size)
 {
-    while (size--) {
-        binwrite_u8(file, 0);
-    }
+	writer->data.insert(writer->data.end(), size, 0);
 }
 
-void binwrite_symbol_ref(FILE *file, std::string name)
+void binwrite_symbol_ref(BinWriter *writer, std::string name)
 {
-	FileSymbol &symbol = file_symbols[name];
+	FileSymbol &symbol = writer->symbols[name];
 	if(symbol.value == -1) {
-		FileSymbolRef ref;
-		ref.file = file;
-		ref.offset = ftell(file);
-		symbol.pending_refs.push_back(ref);
-		binwrite_u32(file, 0);
+		symbol.pending_refs.push_back(binwrite_get_pos(writer));
+		binwrite_u32(writer, 0);
 	} else {
-		binwrite_u32(file, symbol.value);
+		binwrite_u32(writer, symbol.value);
+	}
+}
+
+void binwrite_ptr_ref(BinWriter *writer, std::string name)
+{
+	binwrite_align(writer, writer->ptr_size);
+	writer->relocs.push_back(binwrite_get_pos(writer));
+	// Offsets fit in 32 bits, so wider pointers only need zero padding on the
+	// high side
+	if(writer->ptr_size == 8 && !writer->little_endian) {
+		binwrite_u32(writer, 0);
+	}
+	binwrite_symbol_ref(writer, name);
+	if(writer->ptr_size == 8 && writer->little_endian) {
+		binwrite_u32(writer, 0);
 	}
 }
 
-void binwrite_symbol_set(FILE *file, std::string name)
+void binwrite_ptr_null(BinWriter *writer)
+{
+	binwrite_align(writer, writer->ptr_size);
+	binwrite_pad(writer, writer->ptr_size);
+}
+
+void binwrite_symbol_set(BinWriter *writer, std::string name)
 {
-	binwrite_symbol_setval(file, ftell(file), name);
+	binwrite_symbol_setval(writer, binwrite_get_pos(writer), name);
 }
 
-void binwrite_symbol_setval(FILE *file, int value, std::string name)
+void binwrite_symbol_setval(BinWriter *writer, int value, std::string name)
 {
-	FileSymbol &symbol = file_symbols[name];
+	FileSymbol &symbol = writer->symbols[name];
 	symbol.value = value;
 	for(size_t i=0; i<symbol.pending_refs.size(); i++) {
-		binwrite_u32_at(symbol.pending_refs[i].file,  symbol.pending_refs[i].offset, value);
+		binwrite_u32_at(writer, symbol.pending_refs[i], value);
 	}
+	writer->patched_refs += symbol.pending_refs.size();
 	symbol.pending_refs.clear();
 }
 
-void binwrite_symbol_clear(void)
+void binwrite_symbol_clear(BinWriter *writer)
 {
-	file_symbols.clear();
+	writer->symbols.clear();
 }
 
-int binwrite_symbol_get(std::string name)
+int binwrite_symbol_get(BinWriter *writer, std::string name)
 {
-	FileSymbol &symbol = file_symbols[name];
+	FileSymbol &symbol = writer->symbols[name];
 	return symbol.value;
 }
 
-int binwrite_get_pos(FILE *file)
+int binwrite_get_pos(BinWriter *writer)
+{
+	return writer->data.size();
+}
+
+bool binwrite_save(BinWriter *writer, const char *path)
 {
-	return ftell(file);
-}
\ No newline at end of file
+	// Write next to the destination and rename over it so a failed or
+	// interrupted build never leaves a truncated output behind
+	std::string temp_path = std::string(path) + ".tmp";
+	FILE *file = fopen(temp_path.c_str(), "wb");
+	if(!file) {
+		return false;
+	}
+	bool success = fwrite(writer->data.data(), 1, writer->data.size(), file) == writer->data.size();
+	success = (fclose(file) == 0) && success;
+	std::error_code error;
+	if(success) {
+		fs::rename(temp_path, path, error);
+	}
+	if(!success || error) {
+		fs::remove(temp_path, error);
+		return false;
+	}
+	return true;
+}
@@ -4,18 +4,44 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string>
+#include <vector>
+#include <unordered_map>
 
-void binwrite_u8(FILE *file, uint8_t value);
-void binwrite_u16(FILE *file, uint16_t value);
-void binwrite_u32(FILE *file, uint32_t value);
-void binwrite_string(FILE *file, const char *string);
-void binwrite_align(FILE *file, int align);
-void binwrite_pad(FILE *file, int size);
-void binwrite_symbol_ref(FILE *file, std::string name);
-void binwrite_symbol_set(FILE *file, std::string name);
-void binwrite_symbol_setval(FILE *file, int value, std::string name);
-void binwrite_symbol_clear(void);
-int binwrite_symbol_get(std::string name);
-int binwrite_get_pos(FILE *file);
+struct FileSymbol {
+	int value = -1;
+	std::vector<int> pending_refs = {};
+};
 
-#endif
\ No newline at end of file
+// Output is built in memory and written to disk at once by binwrite_save.
+// Symbols are local to each writer. Values are big endian with 32-bit
+// pointers, as on the N64, unless the writer targets another machine.
+struct BinWriter {
+	std::vector<uint8_t> data;
+	std::unordered_map<std::string, FileSymbol> symbols;
+	bool little_endian = false;
+	int ptr_size = 4;
+	size_t padding = 0; // Bytes added by binwrite_align
+	size_t patched_refs = 0; // References filled in after they were written
+	std::vector<int> relocs; // Positions of the pointers written by binwrite_ptr_ref
+};
+
+void binwrite_u8(BinWriter *writer, uint8_t value);
+void binwrite_u16(BinWriter *writer, uint16_t value);
+void binwrite_u32(BinWriter *writer, uint32_t value);
+void binwrite_string(BinWriter *writer, const char *string);
+void binwrite_data(BinWriter *writer, const void *data, size_t size);
+void binwrite_align(BinWriter *writer, int align);
+void binwrite_pad(BinWriter *writer, int size);
+void binwrite_symbol_ref(BinWriter *writer, std::string name);
+// Pointer sized and aligned fields holding a symbol or NULL. Symbols are
+// recorded in relocs for the runtime to turn into pointers.
+void binwrite_ptr_ref(BinWriter *writer, std::string name);
+void binwrite_ptr_null(BinWriter *writer);
+void binwrite_symbol_set(BinWriter *writer, std::string name);
+void binwrite_symbol_setval(BinWriter *writer, int value, std::string name);
+void binwrite_symbol_clear(BinWriter *writer);
+int binwrite_symbol_get(BinWriter *writer, std::string name);
+int binwrite_get_pos(BinWriter *writer);
+bool binwrite_save(BinWriter *writer, const char *path);
+
+#endif
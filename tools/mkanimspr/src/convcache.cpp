@@ -0,0 +1,117 @@
+#include <atomic>
+#include <filesystem>
+#include <random>
+
+#include "convcache.h"
+
+namespace fs = std::filesystem;
+
+static fs::path cache_dir;
+static std::atomic<uint32_t> cache_hits{0};
+static std::atomic<uint32_t> cache_misses{0};
+
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	for(size_t i=0; i<size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static fs::path GetPath(const ConvCacheKey &key)
+{
+	char name[40];
+	snprintf(name, sizeof(name), "%016llx%016llx.sprite", (unsigned long long)key.hash[0], (unsigned long long)key.hash[1]);
+	return cache_dir / name;
+}
+
+void convcache_init(const char *dir)
+{
+	cache_dir = dir;
+	std::error_code error;
+	fs::create_directories(cache_dir, error);
+}
+
+bool convcache_enabled(void)
+{
+	return !cache_dir.empty();
+}
+
+ConvCacheKey convcache_key(const void *data, size_t size, const std::vector<std::string> &params)
+{
+	// Two FNV-1a streams with different offset bases make up a 128-bit key
+	ConvCacheKey key;
+	key.hash[0] = 0xCBF29CE484222325ULL;
+	key.hash[1] = 0x84222325CBF29CE4ULL;
+	for(int i=0; i<2; i++) {
+		uint64_t size64 = size;
+		key.hash[i] = HashBytes(key.hash[i], &size64, sizeof(size64));
+		key.hash[i] = HashBytes(key.hash[i], data, size);
+		for(size_t j=0; j<params.size(); j++) {
+			// Include the terminator so parameter boundaries are part of the key
+			key.hash[i] = HashBytes(key.hash[i], params[j].c_str(), params[j].size()+1);
+		}
+	}
+	return key;
+}
+
+bool convcache_load(const ConvCacheKey &key, std::vector<uint8_t> &out)
+{
+	if(!convcache_enabled()) {
+		return false;
+	}
+	FILE *file = fopen(GetPath(key).string().c_str(), "rb");
+	if(!file) {
+		cache_misses++;
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	out.resize(size);
+	bool success = size > 0 && fread(out.data(), 1, size, file) == (size_t)size;
+	fclose(file);
+	if(!success) {
+		out.clear();
+		cache_misses++;
+		return false;
+	}
+	cache_hits++;
+	return true;
+}
+
+void convcache_store(const ConvCacheKey &key, const std::vector<uint8_t> &data)
+{
+	if(!convcache_enabled()) {
+		return;
+	}
+	// Write to a unique temporary file first so concurrent builds never see a partial entry
+	fs::path path = GetPath(key);
+	fs::path temp_path = path;
+	temp_path += "." + std::to_string(std::random_device()()) + ".tmp";
+	FILE *file = fopen(temp_path.string().c_str(), "wb");
+	if(!file) {
+		return;
+	}
+	bool success = fwrite(data.data(), 1, data.size(), file) == data.size();
+	success = (fclose(file) == 0) && success;
+	std::error_code error;
+	if(success) {
+		fs::rename(temp_path, path, error);
+	}
+	if(!success || error) {
+		fs::remove(temp_path, error);
+	}
+}
+
+uint32_t convcache_hits(void)
+{
+	return cache_hits;
+}
+
+uint32_t convcache_misses(void)
+{
+	return cache_misses;
+}
@@ -0,0 +1,20 @@
+#ifndef CONVCACHE_H
+#define CONVCACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct ConvCacheKey {
+	uint64_t hash[2];
+};
+
+void convcache_init(const char *dir);
+bool convcache_enabled(void);
+ConvCacheKey convcache_key(const void *data, size_t size, const std::vector<std::string> &params);
+bool convcache_load(const ConvCacheKey &key, std::vector<uint8_t> &out);
+void convcache_store(const ConvCacheKey &key, const std::vector<uint8_t> &data);
+uint32_t convcache_hits(void);
+uint32_t convcache_misses(void);
+
+#endif
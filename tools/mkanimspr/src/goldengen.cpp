@@ -0,0 +1,304 @@
+#include "spriteenc.h"
+
+#include <png.h>
+
+#include <string>
+#include <filesystem>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace fs = std::filesystem;
+
+// Writes golden.spranm, which converts the demo PNGs and a few synthetic ones
+// to every sprite format for comparing the built-in encoder with mksprite.
+// With --check it instead verifies the sprite layout written by the built-in
+// encoder, which needs no toolchain.
+
+struct GoldenImage {
+	const char *name;
+	const char *asset; // File in the asset directory, NULL for synthetic images
+	bool paletted_formats; // Few enough colors for CI4 and CI8 to be lossless
+	bool ci4; // Also few enough for CI4
+};
+
+static const GoldenImage golden_images[] = {
+	{ "paddle", "paddle_1.png", true, true },
+	{ "tiles", "tiles.png", true, false },
+	{ "font", "font.ia4.png", true, true },
+	{ "gradient", NULL, false, false },
+	{ "grey", NULL, false, false },
+	{ "colors", NULL, true, true },
+	{ "palette", NULL, true, true },
+};
+
+static const char *golden_formats[] = { "RGBA16", "RGBA32", "CI4", "CI8", "IA4", "IA8", "IA16", "I4", "I8" };
+
+#define NUM_GOLDEN_IMAGES (sizeof(golden_images)/sizeof(golden_images[0]))
+#define NUM_GOLDEN_FORMATS (sizeof(golden_formats)/sizeof(golden_formats[0]))
+
+static int num_failed;
+
+static void die(const char *fmt, const char *arg)
+{
+	fprintf(stderr, fmt, arg);
+	exit(1);
+}
+
+static void WritePng(const fs::path &path, int width, int height, uint32_t format, const void *pixels, const void *colormap, int colormap_entries)
+{
+	png_image png;
+	memset(&png, 0, sizeof(png));
+	png.version = PNG_IMAGE_VERSION;
+	png.width = width;
+	png.height = height;
+	png.format = format;
+	png.colormap_entries = colormap_entries;
+	if(!png_image_write_to_file(&png, path.string().c_str(), 0, pixels, 0, colormap)) {
+		die("Failed to write %s\n", path.string().c_str());
+	}
+}
+
+// Odd sizes check the padding of 4 bit rows
+static void WriteSynthetic(const fs::path &dir)
+{
+	// Every color and alpha level, too many colors to be paletted
+	std::vector<uint8_t> gradient(37*19*4);
+	for(int y=0; y<19; y++) {
+		for(int x=0; x<37; x++) {
+			uint8_t *px = &gradient[(y*37+x)*4];
+			px[0] = x*255/36;
+			px[1] = y*255/18;
+			px[2] = (x*y*7) & 0xFF;
+			px[3] = (x+y)*255/54;
+		}
+	}
+	WritePng(dir / "gradient.png", 37, 19, PNG_FORMAT_RGBA, gradient.data(), NULL, 0);
+
+	// A grey and alpha PNG
+	std::vector<uint8_t> grey(21*9*2);
+	for(int i=0; i<21*9; i++) {
+		grey[i*2] = (i*13) & 0xFF;
+		grey[i*2+1] = (i*29) & 0xFF;
+	}
+	WritePng(dir / "grey.png", 21, 9, PNG_FORMAT_GA, grey.data(), NULL, 0);
+
+	// A true color PNG with few colors, quantized without loss
+	static const uint8_t colors[6][4] = {
+		{ 0, 0, 0, 0 }, { 255, 0, 0, 255 }, { 0, 255, 0, 255 }, { 0, 0, 255, 255 }, { 255, 255, 255, 255 }, { 128, 64, 32, 255 }
+	};
+	std::vector<uint8_t> few(15*7*4);
+	for(int i=0; i<15*7; i++) {
+		memcpy(&few[i*4], colors[(i*5/3) % 6], 4);
+	}
+	WritePng(dir / "colors.png", 15, 7, PNG_FORMAT_RGBA, few.data(), NULL, 0);
+
+	// A paletted PNG whose palette is not in order of appearance
+	uint8_t colormap[13*4];
+	for(int i=0; i<13; i++) {
+		colormap[i*4] = 255-i*19;
+		colormap[i*4+1] = i*19;
+		colormap[i*4+2] = (i*97) & 0xFF;
+		colormap[i*4+3] = i == 5 ? 0 : 255;
+	}
+	std::vector<uint8_t> indices(23*11);
+	for(int i=0; i<23*11; i++) {
+		indices[i] = 12-(i*7/5) % 13;
+	}
+	WritePng(dir / "palette.png", 23, 11, PNG_FORMAT_RGBA_COLORMAP, indices.data(), colormap, 13);
+}
+
+static bool HasFormat(const GoldenImage &image, const char *format)
+{
+	if(!strcmp(format, "CI4")) {
+		return image.ci4;
+	}
+	if(!strcmp(format, "CI8")) {
+		return image.paletted_formats;
+	}
+	return true;
+}
+
+static fs::path ImagePath(const fs::path &dir, const fs::path &asset_dir, const GoldenImage &image)
+{
+	if(image.asset) {
+		return fs::weakly_canonical(fs::absolute(asset_dir / image.asset));
+	}
+	return dir / (std::string(image.name) + ".png");
+}
+
+static void WriteGolden(const fs::path &dir, const fs::path &asset_dir)
+{
+	std::string anims = "\t\t<animation name=\"all\" delay=\"1\">\n";
+	std::string images;
+	for(size_t i=0; i<NUM_GOLDEN_IMAGES; i++) {
+		for(size_t j=0; j<NUM_GOLDEN_FORMATS; j++) {
+			if(!HasFormat(golden_images[i], golden_formats[j])) {
+				continue;
+			}
+			std::string id = std::string(golden_images[i].name) + "_" + golden_formats[j];
+			anims += "\t\t\t<frame image=\"" + id + "\"/>\n";
+			images += "\t\t<image filename=\"" + ImagePath("", asset_dir, golden_images[i]).string() + "\" id=\"" + id + "\" format=\"" + golden_formats[j] + "\"/>\n";
+		}
+	}
+	anims += "\t\t</animation>\n";
+	std::string text = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<animsprite>\n";
+	text += "\t<animations>\n" + anims + "\t</animations>\n";
+	text += "\t<images>\n" + images + "\t</images>\n";
+	text += "</animsprite>\n";
+	fs::path path = dir / "golden.spranm";
+	FILE *file = fopen(path.string().c_str(), "wb");
+	if(!file || fwrite(text.data(), 1, text.size(), file) != text.size() || fclose(file) != 0) {
+		die("Failed to write %s\n", path.string().c_str());
+	}
+}
+
+#define CHECK(cond, what) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s %s: %s\n", id.c_str(), what, #cond); \
+		num_failed++; \
+		return; \
+	} \
+} while(0)
+
+static uint32_t r16(const std::vector<uint8_t> &data, size_t pos)
+{
+	return (data[pos] << 8) | data[pos+1];
+}
+
+// Reads texel x, y as a palette index or packed value of bpp bits
+static uint32_t ReadTexel(const std::vector<uint8_t> &data, int width, int bpp, int x, int y)
+{
+	size_t pos = 8+(size_t)y*((width*bpp+7)/8)+x*bpp/8;
+	switch(bpp) {
+		case 4:
+			return (x & 1) ? (data[pos] & 0xF) : (data[pos] >> 4);
+
+		case 8:
+			return data[pos];
+
+		case 16:
+			return r16(data, pos);
+
+		default:
+			return (r16(data, pos) << 16) | r16(data, pos+2);
+	}
+}
+
+static uint16_t ToRGBA16(const uint8_t *px)
+{
+	return ((px[0] >> 3) << 11) | ((px[1] >> 3) << 6) | ((px[2] >> 3) << 1) | (px[3] >> 7);
+}
+
+// Checks the header, extension and texels of one encoded sprite against the
+// pixels it came from
+static void CheckSprite(const std::string &id, const SpriteImage &image, const char *format, int bpp, int fmt)
+{
+	std::vector<uint8_t> out;
+	std::string error;
+	CHECK(spriteenc_encode(out, image, format, "NONE", error), "encode");
+	CHECK(out.size() % 8 == 0, "size");
+	CHECK((int)r16(out, 0) == image.width && (int)r16(out, 2) == image.height, "size");
+	CHECK(out[4] == bpp/8, "legacy bitdepth");
+	CHECK(out[5] == (fmt | 0x80) && out[6] == 1 && out[7] == 1, "format and slices");
+	size_t ext = (8+(size_t)image.height*((image.width*bpp+7)/8)+7) & ~7;
+	CHECK(ext+124 <= out.size() && r16(out, ext) == 124 && r16(out, ext+2) == 4, "extension header");
+	size_t pal_pos = (r16(out, ext+4) << 16) | r16(out, ext+6);
+	for(size_t i=ext+8; i<ext+124; i++) {
+		CHECK(out[i] == 0, "LODs, flags and texparms");
+	}
+	bool paletted = bpp <= 8 && fmt < 12;
+	CHECK(paletted ? pal_pos == ((ext+124+7) & ~7) && pal_pos+(2 << bpp) == out.size() : pal_pos == 0 && out.size() == ext+128, "palette position");
+	for(int y=0; y<image.height; y++) {
+		for(int x=0; x<image.width; x++) {
+			const uint8_t *px = &image.pixels[(y*image.width+x)*4];
+			uint32_t texel = ReadTexel(out, image.width, bpp, x, y);
+			int intensity = (px[0]*299 + px[1]*587 + px[2]*114 + 500) / 1000;
+			switch(fmt) {
+				case 2:
+					CHECK(texel == ToRGBA16(px), "RGBA16 texel");
+					break;
+
+				case 3:
+					CHECK(texel == (uint32_t)((px[0] << 24) | (px[1] << 16) | (px[2] << 8) | px[3]), "RGBA32 texel");
+					break;
+
+				case 8:
+				case 9:
+				{
+					uint16_t color = r16(out, pal_pos+texel*2);
+					if(!image.indices.empty()) {
+						CHECK(texel == image.indices[y*image.width+x], "index in PNG palette order");
+						CHECK(color == ToRGBA16(&image.colormap[texel*4]), "palette color");
+					} else {
+						CHECK(px[3] == 0 ? color == 0 : color == ToRGBA16(px), "palette color");
+					}
+				}
+					break;
+
+				case 12:
+					CHECK(texel == (uint32_t)(((intensity >> 5) << 1) | (px[3] >> 7)), "IA4 texel");
+					break;
+
+				case 13:
+					CHECK(texel == (uint32_t)((intensity & 0xF0) | (px[3] >> 4)), "IA8 texel");
+					break;
+
+				case 14:
+					CHECK(texel == (uint32_t)((intensity << 8) | px[3]), "IA16 texel");
+					break;
+
+				case 16:
+					CHECK(texel == (uint32_t)(intensity >> 4), "I4 texel");
+					break;
+
+				case 17:
+					CHECK(texel == (uint32_t)intensity, "I8 texel");
+					break;
+			}
+		}
+	}
+}
+
+static void CheckGolden(const fs::path &dir, const fs::path &asset_dir)
+{
+	static const int formats[NUM_GOLDEN_FORMATS][2] = {
+		{ 16, 2 }, { 32, 3 }, { 4, 8 }, { 8, 9 }, { 4, 12 }, { 8, 13 }, { 16, 14 }, { 4, 16 }, { 8, 17 }
+	};
+	int num_sprites = 0;
+	for(size_t i=0; i<NUM_GOLDEN_IMAGES; i++) {
+		SpriteImage image;
+		std::string error;
+		if(!spriteenc_load_png_file(image, ImagePath(dir, asset_dir, golden_images[i]).string().c_str(), error)) {
+			die("Failed to load image: %s\n", error.c_str());
+		}
+		for(size_t j=0; j<NUM_GOLDEN_FORMATS; j++) {
+			if(HasFormat(golden_images[i], golden_formats[j])) {
+				std::string id = std::string(golden_images[i].name) + "_" + golden_formats[j];
+				CheckSprite(id, image, golden_formats[j], formats[j][0], formats[j][1]);
+				num_sprites++;
+			}
+		}
+	}
+	printf("%d sprites checked, %d failed\n", num_sprites, num_failed);
+}
+
+int main(int argc, char **argv)
+{
+	bool check = argc == 4 && !strcmp(argv[1], "--check");
+	if(argc != 3 && !check) {
+		fprintf(stderr, "Usage: %s [--check] <output directory> <asset directory>\n", argv[0]);
+		return 1;
+	}
+	fs::path dir = argv[argc-2];
+	fs::path asset_dir = argv[argc-1];
+	fs::create_directories(dir);
+	WriteSynthetic(dir);
+	if(check) {
+		CheckGolden(dir, asset_dir);
+		return num_failed ? 1 : 0;
+	}
+	WriteGolden(dir, asset_dir);
+	return 0;
+}
@@ -0,0 +1,134 @@
+#include <string.h>
+#include <algorithm>
+
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+// The last match must start this many bytes before the end of the block and
+// the block must end with at least this many literals
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_LAST_LITERALS 5
+#define LZ4_HASH_BITS 16
+
+static uint32_t ReadU32(const uint8_t *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static uint32_t Hash(uint32_t value)
+{
+	return (value*2654435761u) >> (32-LZ4_HASH_BITS);
+}
+
+static void WriteLength(std::vector<uint8_t> &out, size_t length)
+{
+	while(length >= 255) {
+		out.push_back(255);
+		length -= 255;
+	}
+	out.push_back(length);
+}
+
+static void WriteSequence(std::vector<uint8_t> &out, const uint8_t *literals, size_t num_literals, size_t offset, size_t match_len)
+{
+	size_t match_code = match_len ? match_len-LZ4_MIN_MATCH : 0;
+	out.push_back((std::min<size_t>(num_literals, 15) << 4) | std::min<size_t>(match_code, 15));
+	if(num_literals >= 15) {
+		WriteLength(out, num_literals-15);
+	}
+	out.insert(out.end(), literals, literals+num_literals);
+	if(match_len == 0) {
+		return;
+	}
+	out.push_back(offset & 0xFF);
+	out.push_back(offset >> 8);
+	if(match_code >= 15) {
+		WriteLength(out, match_code-15);
+	}
+}
+
+// Greedy compressor matching the most recent position with the same hash
+void lz4_compress(const uint8_t *data, size_t size, std::vector<uint8_t> &out)
+{
+	out.clear();
+	std::vector<int64_t> table(1 << LZ4_HASH_BITS, -1);
+	size_t anchor = 0;
+	size_t pos = 0;
+	if(size > LZ4_MATCH_LIMIT) {
+		size_t match_limit = size-LZ4_MATCH_LIMIT;
+		size_t match_end_limit = size-LZ4_LAST_LITERALS;
+		while(pos <= match_limit) {
+			uint32_t hash = Hash(ReadU32(&data[pos]));
+			int64_t candidate = table[hash];
+			table[hash] = pos;
+			if(candidate < 0 || pos-candidate > LZ4_MAX_OFFSET || ReadU32(&data[candidate]) != ReadU32(&data[pos])) {
+				pos++;
+				continue;
+			}
+			size_t match_len = LZ4_MIN_MATCH;
+			while(pos+match_len < match_end_limit && data[candidate+match_len] == data[pos+match_len]) {
+				match_len++;
+			}
+			WriteSequence(out, &data[anchor], pos-anchor, pos-candidate, match_len);
+			pos += match_len;
+			anchor = pos;
+		}
+	}
+	WriteSequence(out, &data[anchor], size-anchor, 0, 0);
+}
+
+bool lz4_decompress(const uint8_t *data, size_t size, std::vector<uint8_t> &out, size_t out_size)
+{
+	out.clear();
+	out.reserve(out_size);
+	size_t pos = 0;
+	while(pos < size) {
+		uint8_t token = data[pos++];
+		size_t num_literals = token >> 4;
+		if(num_literals == 15) {
+			uint8_t byte;
+			do {
+				if(pos >= size) {
+					return false;
+				}
+				byte = data[pos++];
+				num_literals += byte;
+			} while(byte == 255);
+		}
+		if(pos+num_literals > size) {
+			return false;
+		}
+		out.insert(out.end(), &data[pos], &data[pos]+num_literals);
+		pos += num_literals;
+		if(pos == size) {
+			break;
+		}
+		if(pos+2 > size) {
+			return false;
+		}
+		size_t offset = data[pos] | (data[pos+1] << 8);
+		pos += 2;
+		size_t match_len = (token & 15)+LZ4_MIN_MATCH;
+		if((token & 15) == 15) {
+			uint8_t byte;
+			do {
+				if(pos >= size) {
+					return false;
+				}
+				byte = data[pos++];
+				match_len += byte;
+			} while(byte == 255);
+		}
+		if(offset == 0 || offset > out.size()) {
+			return false;
+		}
+		size_t match = out.size()-offset;
+		for(size_t i=0; i<match_len; i++) {
+			out.push_back(out[match+i]);
+		}
+	}
+	return out.size() == out_size;
+}
@@ -0,0 +1,13 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+#include <vector>
+
+// Compresses data as a single LZ4 block, without frame header or checksums
+void lz4_compress(const uint8_t *data, size_t size, std::vector<uint8_t> &out);
+// Decompresses an LZ4 block. Returns false if the block is malformed or does
+// not decompress to exactly size bytes.
+bool lz4_decompress(const uint8_t *data, size_t size, std::vector<uint8_t> &out, size_t out_size);
+
+#endif
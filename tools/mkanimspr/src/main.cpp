@@ -1,17 +1,33 @@
 #include "tinyxml2.h"
 #include "binwrite.h"
+#include "spriteenc.h"
+#include "convcache.h"
+#include "atlas.h"
+#include "lz4.h"
+#include "trace.h"
 #include "subprocess.h"
+#include "asprformat.h"
 
 #include <vector>
 #include <map>
+#include <functional>
+#include <unordered_map>
 
 #include <string>
 #include <filesystem>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
 
 #include <stdarg.h>
+#include <ctype.h>
 
 namespace fs = std::filesystem;
 
+// Differing bytes of a delta closer than this are merged into one span
+#define DELTA_SPAN_GAP 16
+
 struct FrameData {
 	std::string image;
 	uint16_t time;
@@ -30,6 +46,95 @@ struct ImageData {
 	std::string dither_algo;
 };
 
+struct SheetOptions {
+	bool stream = false;
+	bool atlas = false;
+	bool trim = false;
+	bool shared_palette = false;
+	bool compress = false;
+	bool chunked = false; // Sprites stored per animation in the .dat file and loaded on first use
+	int delta_interval = 0; // Keyframe interval of delta encoded frames, 0 if disabled
+	int atlas_width = 256;
+	int atlas_height = 256;
+	bool host = false; // Native byte order and pointer size instead of the N64's
+	std::string header_dir; // Where to write the animation index header, empty if not wanted
+};
+
+// Where the time converting a sheet went, in nanoseconds, and what came out
+struct SheetReport {
+	uint64_t xml_ns = 0; // Reading and parsing the .spranm file
+	uint64_t convert_ns = 0; // Loading, trimming, packing and encoding images
+	uint64_t pack_ns = 0; // Merging duplicates, delta encoding and compression
+	uint64_t layout_ns = 0; // Laying out the file and patching symbol references
+	uint64_t write_ns = 0; // Writing the output files
+	size_t num_frames = 0;
+	size_t num_images = 0;
+	size_t num_sprites = 0;
+	size_t output_size = 0;
+	// Output bytes by what they hold
+	size_t header_bytes = 0; // Fixed fields and the animation table
+	size_t table_bytes = 0; // Frame lists, name hash, image rects and sprite, delta and relocation tables
+	size_t name_bytes = 0;
+	size_t palette_bytes = 0;
+	size_t sprite_bytes = 0;
+	size_t delta_bytes = 0;
+	size_t padding_bytes = 0;
+	size_t patched_refs = 0;
+	// Images and conversion time by the format named in the sheet. Atlas pages
+	// count toward the format of the images on them.
+	struct FormatReport {
+		size_t num_images = 0;
+		uint64_t convert_ns = 0;
+	};
+	std::map<std::string, FormatReport> formats;
+};
+
+// Splits the bytes written to a file by what they hold, leaving out alignment
+struct ByteCounter {
+	BinWriter *writer;
+	size_t pos = 0;
+	size_t padding = 0;
+	
+	ByteCounter(BinWriter *writer) : writer(writer) {}
+	// Adds the bytes written since the previous call to total
+	void Add(size_t &total)
+	{
+		total += (writer->data.size()-pos)-(writer->padding-padding);
+		pos = writer->data.size();
+		padding = writer->padding;
+	}
+};
+
+struct SheetJob {
+	std::string input;
+	std::string output;
+	SheetOptions options;
+	SheetReport report;
+};
+
+
+// A sprite to convert. It comes straight from a PNG file or from pixels
+// generated by the converter, such as atlas pages.
+struct SpriteSource {
+	std::string name;
+	std::string filename; // Empty for generated pixels
+	SpriteImage image;
+	std::string format;
+	std::string dither_algo;
+	const std::vector<uint16_t> *palette = NULL; // Shared palette of the sheet, if used
+};
+
+// Where an image is found inside its stored sprite
+struct ImageRect {
+	uint16_t sprite_idx = 0;
+	uint16_t s = 0;
+	uint16_t t = 0;
+	uint16_t width = 0;
+	uint16_t height = 0;
+	int16_t x_ofs = 0;
+	int16_t y_ofs = 0;
+};
+
 struct AnimSprData {
 	std::vector<AnimData> anims;
 	std::vector<ImageData> images;
@@ -37,7 +142,28 @@ struct AnimSprData {
 };
 
 const char *n64_inst = NULL;
-bool stream_flag = false;
+int num_jobs = 1;
+bool external_mksprite_flag = false;
+bool compare_mksprite_flag = false;
+bool stats_flag = false;
+const char *timings_path = NULL;
+const char *trace_path = NULL;
+// Conversion time of every image for --stats
+static std::mutex image_time_mutex;
+static std::vector<std::pair<uint64_t, std::string>> image_times;
+std::atomic<uint32_t> dedupe_sprites{0};
+std::atomic<size_t> dedupe_bytes{0};
+std::atomic<uint32_t> delta_frames{0};
+std::atomic<size_t> delta_bytes_saved{0};
+std::atomic<uint32_t> delta_sprites_dropped{0};
+std::atomic<size_t> delta_sprite_bytes_saved{0};
+std::atomic<uint32_t> compressed_frames{0};
+std::atomic<size_t> compress_bytes_saved{0};
+
+// Serializes spawning mksprite and feeding its stdin. Pipe handles are
+// inherited by every child spawned while they are open, so a child started
+// by another thread could keep our stdin open and mksprite would never see EOF.
+static std::mutex spawn_mutex;
 
 void die(const char *fmt, ...)
 {
@@ -148,48 +274,42 @@ void ReadXML(const char *path, AnimSprData &animspr)
 	ParseImages(animspr, path, images);
 }
 
-void ConvertImage(FILE *file, ImageData *image)
+void ConvertImageExternal(std::vector<uint8_t> &out, SpriteSource *source, const std::vector<uint8_t> &png)
 {
-    static char *mksprite = NULL;
-    if (!mksprite) asprintf(&mksprite, "%s/bin/mksprite", n64_inst);
+    std::string mksprite = std::string(n64_inst) + "/bin/mksprite";
 
     // Prepare mksprite command line
     struct subprocess_s subp;
     const char *cmd_addr[16] = {0}; int i = 0;
-    cmd_addr[i++] = mksprite;
+    cmd_addr[i++] = mksprite.c_str();
     cmd_addr[i++] = "--format";
-    cmd_addr[i++] = image->format.c_str();
+    cmd_addr[i++] = source->format.c_str();
 	cmd_addr[i++] = "--dither";
-    cmd_addr[i++] = image->dither_algo.c_str();
+    cmd_addr[i++] = source->dither_algo.c_str();
     cmd_addr[i++] = "--compress";  // don't compress the individual sprite (the sprite itself will be compressed)
     cmd_addr[i++] = "0";
-    FILE *image_file = fopen(image->filename.c_str(), "rb");
-	if(!image_file) {
-		die("Failed to open %s for writing.\n", image->filename.c_str());
-	}
-    // Start mksprite
-    if (subprocess_create(cmd_addr, subprocess_option_no_window|subprocess_option_inherit_environment, &subp) != 0) {
-        die("Error: cannot run: %s\n", mksprite);
-    }
+	{
+		std::lock_guard<std::mutex> lock(spawn_mutex);
+		TraceScope scope("mksprite", "spawn", source->name);
+		// Start mksprite
+		if (subprocess_create(cmd_addr, subprocess_option_no_window|subprocess_option_inherit_environment, &subp) != 0) {
+			die("Error: cannot run: %s\n", mksprite.c_str());
+		}
 
-    // Write PNG to standard input of mksprite
-    FILE *mksprite_in = subprocess_stdin(&subp);
-	while (1) {
-        uint8_t buf[4096];
-        int n = fread(buf, 1, sizeof(buf), image_file);
-        if (n == 0) break;
-		fwrite(buf, 1, n, mksprite_in);
-    }
-    fclose(mksprite_in); subp.stdin_file = SUBPROCESS_NULL;
-	fclose(image_file);
+		// Write PNG to standard input of mksprite
+		FILE *mksprite_in = subprocess_stdin(&subp);
+		fwrite(png.data(), 1, png.size(), mksprite_in);
+		fclose(mksprite_in); subp.stdin_file = SUBPROCESS_NULL;
+	}
 	
     // Read sprite from stdout into memory
+    TraceScope scope("mksprite", "read output", source->name);
     FILE *mksprite_out = subprocess_stdout(&subp);
     while (1) {
         uint8_t buf[4096];
         int n = fread(buf, 1, sizeof(buf), mksprite_out);
         if (n == 0) break;
-        fwrite(buf, 1, n, file);
+        out.insert(out.end(), buf, buf+n);
     }
 
     // Dump mksprite's stderr. Whatever is printed there (if anything) is useful to see
@@ -210,33 +330,801 @@ void ConvertImage(FILE *file, ImageData *image)
     subprocess_destroy(&subp);
 }
 
-void WriteAnimSpr(const char *path, AnimSprData &data)
+void ConvertImageInternal(std::vector<uint8_t> &out, SpriteSource *source, const std::vector<uint8_t> &png)
 {
-	fs::path spr_data_path{path};
-	spr_data_path.replace_extension(spr_data_path.extension().string()+".dat");
-	FILE *file = fopen(path, "wb");
+	std::string error;
+	if(png.empty()) {
+		if(!spriteenc_encode(out, source->image, source->format.c_str(), source->dither_algo.c_str(), error, source->palette)) {
+			die("Failed to convert %s: %s\n", source->name.c_str(), error.c_str());
+		}
+		return;
+	}
+	SpriteImage sprite_image;
+	if(!spriteenc_load_png(sprite_image, png.data(), png.size(), error)) {
+		die("Failed to load %s: %s\n", source->name.c_str(), error.c_str());
+	}
+	if(!spriteenc_encode(out, sprite_image, source->format.c_str(), source->dither_algo.c_str(), error)) {
+		die("Failed to convert %s: %s\n", source->name.c_str(), error.c_str());
+	}
+}
+
+void ReadFile(const char *path, std::vector<uint8_t> &out)
+{
+	FILE *file = fopen(path, "rb");
 	if(!file) {
-		die("Failed to open %s for writing\n", path);
+		die("Failed to open %s for reading.\n", path);
+	}
+	while (1) {
+		uint8_t buf[65536];
+		size_t n = fread(buf, 1, sizeof(buf), file);
+		if (n == 0) break;
+		out.insert(out.end(), buf, buf+n);
+	}
+	fclose(file);
+}
+
+// Identifies the mksprite binary by a hash of its contents so blobs it wrote
+// are not reused after a toolchain upgrade
+const std::string &MkspriteIdentity()
+{
+	static const std::string identity = []() {
+		std::vector<uint8_t> data;
+		ReadFile((std::string(n64_inst) + "/bin/mksprite").c_str(), data);
+		ConvCacheKey key = convcache_key(data.data(), data.size(), {});
+		char text[48];
+		snprintf(text, sizeof(text), "mksprite%016llx%016llx", (unsigned long long)key.hash[0], (unsigned long long)key.hash[1]);
+		return std::string(text);
+	}();
+	return identity;
+}
+
+void ConvertImage(std::vector<uint8_t> &out, SpriteSource *source)
+{
+	std::vector<uint8_t> png;
+	std::string encoder = external_mksprite_flag ? MkspriteIdentity() : "spriteenc" + std::to_string(SPRITEENC_VERSION);
+	// The cache key covers everything that affects the converted bytes
+	ConvCacheKey key;
+	if(!source->filename.empty()) {
+		TraceScope scope("io", "read png", source->name);
+		ReadFile(source->filename.c_str(), png);
+		key = convcache_key(png.data(), png.size(), { source->format, source->dither_algo, encoder });
+	} else {
+		std::string size = std::to_string(source->image.width) + "x" + std::to_string(source->image.height);
+		std::string palette;
+		if(source->palette) {
+			palette.assign((const char *)source->palette->data(), source->palette->size()*sizeof(uint16_t));
+		}
+		// AutoFormat picks the format from the flags of the source PNG
+		const SpriteImage &image = source->image;
+		std::string flags = std::string(image.paletted ? "p" : "") + (image.color ? "c" : "") + (image.alpha ? "a" : "");
+		// CI formats keep the palette order of the PNG while it still matches
+		std::string colormap(image.colormap.begin(), image.colormap.end());
+		std::string indices(image.indices.begin(), image.indices.end());
+		key = convcache_key(image.pixels.data(), image.pixels.size(), { source->format, source->dither_algo, encoder, size, palette, flags, colormap, indices });
+	}
+	// Cached sprites would skip the comparison with mksprite
+	if(!compare_mksprite_flag && convcache_load(key, out)) {
+		return;
+	}
+	if(png.empty() && (external_mksprite_flag || compare_mksprite_flag)) {
+		std::string error;
+		if(!spriteenc_save_png(png, source->image, error)) {
+			die("Failed to write PNG for %s: %s\n", source->name.c_str(), error.c_str());
+		}
+	}
+	if(external_mksprite_flag) {
+		ConvertImageExternal(out, source, png);
+		convcache_store(key, out);
+		return;
+	}
+	{
+		TraceScope scope("encode", "encode", source->name);
+		ConvertImageInternal(out, source, source->filename.empty() ? std::vector<uint8_t>() : png);
+	}
+	convcache_store(key, out);
+	if(compare_mksprite_flag && !source->palette) {
+		// Check the built-in encoder against mksprite for this image
+		std::vector<uint8_t> reference;
+		ConvertImageExternal(reference, source, png);
+		SpriteImage image = source->image;
+		std::string error;
+		if(!source->filename.empty() && !spriteenc_load_png(image, png.data(), png.size(), error)) {
+			die("Failed to load %s: %s\n", source->name.c_str(), error.c_str());
+		}
+		if(!spriteenc_compare(image, out, reference, error)) {
+			die("Built-in encoder output for %s differs from mksprite: %s\n", source->name.c_str(), error.c_str());
+		}
+	}
+}
+
+// Returns the time taken in nanoseconds
+uint64_t ConvertImageTimed(std::vector<uint8_t> &out, SpriteSource *source)
+{
+	TraceScope scope("image", source->name);
+	ConvertImage(out, source);
+	uint64_t elapsed = scope.Elapsed();
+	if(stats_flag) {
+		std::lock_guard<std::mutex> lock(image_time_mutex);
+		image_times.emplace_back(elapsed, source->name);
+	}
+	return elapsed;
+}
+
+// Fills image_ns with the time taken by each source
+void ConvertImages(std::vector<SpriteSource> &sources, std::vector<std::vector<uint8_t>> &sprites, std::vector<uint64_t> &image_ns, size_t num_threads)
+{
+	sprites.clear();
+	sprites.resize(sources.size());
+	image_ns.assign(sources.size(), 0);
+	if(num_threads > sources.size()) {
+		num_threads = sources.size();
+	}
+	if(num_threads <= 1) {
+		for(size_t i=0; i<sources.size(); i++) {
+			image_ns[i] = ConvertImageTimed(sprites[i], &sources[i]);
+		}
+		return;
+	}
+	// Each worker claims the next unconverted image. Results land in their own
+	// slot so the output order does not depend on which conversion ends first.
+	std::atomic<size_t> next_image{0};
+	std::vector<std::thread> workers;
+	for(size_t i=0; i<num_threads; i++) {
+		workers.emplace_back([&]() {
+			size_t image;
+			while((image = next_image++) < sources.size()) {
+				image_ns[image] = ConvertImageTimed(sprites[image], &sources[image]);
+			}
+		});
+	}
+	for(size_t i=0; i<workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+void LoadImagePixels(ImageData &image, SpriteImage &pixels)
+{
+	TraceScope scope("io", "read png", image.filename);
+	std::string error;
+	if(!spriteenc_load_png_file(pixels, image.filename.c_str(), error)) {
+		die("Failed to load %s: %s\n", image.filename.c_str(), error.c_str());
+	}
+}
+
+// Packs the images into atlas pages. Images are grouped by format and dither
+// algorithm since every page is converted as a single sprite.
+void BuildAtlas(AnimSprData &data, const SheetOptions &options, std::vector<SpriteImage> &pixels,
+	std::vector<SpriteSource> &sources, std::vector<ImageRect> &rects)
+{
+	std::vector<std::string> group_keys;
+	std::map<std::string, std::vector<size_t>> groups;
+	for(size_t i=0; i<data.images.size(); i++) {
+		std::string group_key = data.images[i].format + "\n" + data.images[i].dither_algo;
+		if(groups.count(group_key) == 0) {
+			group_keys.push_back(group_key);
+		}
+		groups[group_key].push_back(i);
+	}
+	for(size_t i=0; i<group_keys.size(); i++) {
+		std::vector<size_t> &group = groups[group_keys[i]];
+		// Identical frames share one spot in the atlas
+		std::unordered_map<uint64_t, std::vector<size_t>> hash_map;
+		std::vector<AtlasItem> items;
+		std::vector<size_t> item_image;
+		std::vector<size_t> image_item(group.size());
+		for(size_t j=0; j<group.size(); j++) {
+			SpriteImage &image = pixels[group[j]];
+			std::string size = std::to_string(image.width) + "x" + std::to_string(image.height);
+			uint64_t hash = convcache_key(image.pixels.data(), image.pixels.size(), { size }).hash[0];
+			std::vector<size_t> &candidates = hash_map[hash];
+			size_t item;
+			for(item=0; item<candidates.size(); item++) {
+				SpriteImage &other = pixels[item_image[candidates[item]]];
+				if(other.width == image.width && other.height == image.height && other.pixels == image.pixels) {
+					break;
+				}
+			}
+			if(item != candidates.size()) {
+				image_item[j] = candidates[item];
+				continue;
+			}
+			image_item[j] = items.size();
+			candidates.push_back(items.size());
+			item_image.push_back(group[j]);
+			AtlasItem new_item;
+			new_item.width = image.width;
+			new_item.height = image.height;
+			items.push_back(new_item);
+		}
+		std::vector<AtlasPage> pages;
+		// Sub-rectangles of 4bpp sprites must start on a byte
+		atlas_pack(items, pages, options.atlas_width, options.atlas_height, 2);
+		size_t page_base = sources.size();
+		ImageData &first = data.images[group[0]];
+		for(size_t j=0; j<pages.size(); j++) {
+			SpriteSource source;
+			source.name = first.filename + " atlas page " + std::to_string(page_base+j);
+			source.format = first.format;
+			source.dither_algo = first.dither_algo;
+			source.image.width = pages[j].width;
+			source.image.height = pages[j].height;
+			source.image.paletted = true;
+			source.image.pixels.resize(pages[j].width*pages[j].height*4);
+			sources.push_back(source);
+		}
+		for(size_t j=0; j<items.size(); j++) {
+			SpriteImage &image = pixels[item_image[j]];
+			SpriteImage &page = sources[page_base+items[j].page].image;
+			page.paletted = page.paletted && image.paletted;
+			page.color = page.color || image.color;
+			page.alpha = page.alpha || image.alpha;
+			for(int y=0; y<image.height; y++) {
+				memcpy(&page.pixels[((items[j].y+y)*page.width+items[j].x)*4], &image.pixels[y*image.width*4], image.width*4);
+			}
+		}
+		for(size_t j=0; j<group.size(); j++) {
+			AtlasItem &item = items[image_item[j]];
+			ImageRect &rect = rects[group[j]];
+			rect.sprite_idx = page_base+item.page;
+			rect.s = item.x;
+			rect.t = item.y;
+			rect.width = item.width;
+			rect.height = item.height;
+		}
+	}
+}
+
+// Crops an image to the bounding box of its visible pixels and stores the
+// position of the box in rect
+void TrimImage(SpriteImage &image, ImageRect &rect)
+{
+	int min_x = image.width, min_y = image.height;
+	int max_x = -1, max_y = -1;
+	for(int y=0; y<image.height; y++) {
+		for(int x=0; x<image.width; x++) {
+			if(image.pixels[(y*image.width+x)*4+3] != 0) {
+				min_x = std::min(min_x, x);
+				max_x = std::max(max_x, x);
+				min_y = std::min(min_y, y);
+				max_y = std::max(max_y, y);
+			}
+		}
+	}
+	if(max_x < 0) {
+		// Keep a single transparent pixel for empty frames
+		min_x = min_y = max_x = max_y = 0;
+	}
+	int width = max_x-min_x+1;
+	int height = max_y-min_y+1;
+	std::vector<uint8_t> pixels(width*height*4);
+	for(int y=0; y<height; y++) {
+		memcpy(&pixels[y*width*4], &image.pixels[((min_y+y)*image.width+min_x)*4], width*4);
+	}
+	image.width = width;
+	image.height = height;
+	image.pixels = std::move(pixels);
+	rect.x_ofs = min_x;
+	rect.y_ofs = min_y;
+}
+
+// Quantizes all paletted sprites of a sheet to one palette
+void BuildSharedPalette(std::vector<SpriteSource> &sources, std::vector<uint16_t> &palette)
+{
+	std::vector<const SpriteImage *> images;
+	std::string format;
+	for(size_t i=0; i<sources.size(); i++) {
+		if(sources[i].format != "CI4" && sources[i].format != "CI8") {
+			continue;
+		}
+		if(!format.empty() && sources[i].format != format) {
+			die("A shared palette requires all paletted images to use the same format (%s and %s found)\n",
+				format.c_str(), sources[i].format.c_str());
+		}
+		format = sources[i].format;
+		images.push_back(&sources[i].image);
+	}
+	palette.clear();
+	if(images.empty()) {
+		return;
+	}
+	spriteenc_quantize(images, format == "CI4" ? 16 : 256, palette);
+	for(size_t i=0; i<sources.size(); i++) {
+		if(sources[i].format == format) {
+			sources[i].palette = &palette;
+		}
+	}
+}
+
+// Places the images of each format on a canvas covering all of them so their
+// sprites have the same size and can be delta encoded against each other
+void BuildDeltaCanvas(AnimSprData &data, std::vector<SpriteImage> &pixels, std::vector<ImageRect> &rects)
+{
+	std::map<std::string, std::vector<size_t>> groups;
+	for(size_t i=0; i<data.images.size(); i++) {
+		groups[data.images[i].format + "\n" + data.images[i].dither_algo].push_back(i);
+	}
+	for(auto &group : groups) {
+		int min_x = INT32_MAX, min_y = INT32_MAX;
+		int max_x = INT32_MIN, max_y = INT32_MIN;
+		for(size_t i : group.second) {
+			min_x = std::min(min_x, (int)rects[i].x_ofs);
+			min_y = std::min(min_y, (int)rects[i].y_ofs);
+			max_x = std::max(max_x, rects[i].x_ofs+pixels[i].width);
+			max_y = std::max(max_y, rects[i].y_ofs+pixels[i].height);
+		}
+		int width = max_x-min_x;
+		int height = max_y-min_y;
+		for(size_t i : group.second) {
+			SpriteImage &image = pixels[i];
+			std::vector<uint8_t> canvas(width*height*4);
+			int x = rects[i].x_ofs-min_x;
+			int y = rects[i].y_ofs-min_y;
+			for(int j=0; j<image.height; j++) {
+				memcpy(&canvas[((y+j)*width+x)*4], &image.pixels[j*image.width*4], image.width*4);
+			}
+			image.width = width;
+			image.height = height;
+			image.pixels = std::move(canvas);
+			rects[i].x_ofs = min_x;
+			rects[i].y_ofs = min_y;
+		}
+	}
+}
+
+// Creates the list of sprites to convert and where each image ends up in them
+void BuildSources(AnimSprData &data, const SheetOptions &options, std::vector<SpriteSource> &sources, std::vector<ImageRect> &rects)
+{
+	sources.clear();
+	rects.clear();
+	rects.resize(data.images.size());
+	if(!options.atlas && !options.trim && !options.shared_palette && !options.delta_interval) {
+		for(size_t i=0; i<data.images.size(); i++) {
+			SpriteSource source;
+			source.name = data.images[i].filename;
+			source.filename = data.images[i].filename;
+			source.format = data.images[i].format;
+			source.dither_algo = data.images[i].dither_algo;
+			sources.push_back(source);
+			rects[i].sprite_idx = i;
+		}
+		return;
+	}
+	std::vector<SpriteImage> pixels(data.images.size());
+	for(size_t i=0; i<data.images.size(); i++) {
+		LoadImagePixels(data.images[i], pixels[i]);
+		if(options.trim) {
+			TrimImage(pixels[i], rects[i]);
+		}
+	}
+	if(options.atlas) {
+		BuildAtlas(data, options, pixels, sources, rects);
+		return;
+	}
+	if(options.delta_interval) {
+		BuildDeltaCanvas(data, pixels, rects);
+	}
+	for(size_t i=0; i<data.images.size(); i++) {
+		SpriteSource source;
+		source.name = data.images[i].filename;
+		source.image = std::move(pixels[i]);
+		source.format = data.images[i].format;
+		source.dither_algo = data.images[i].dither_algo;
+		sources.push_back(source);
+		rects[i].sprite_idx = i;
+	}
+}
+
+// Merges images that converted to identical sprites. Fills sprite_idx with
+// the stored sprite used by each image and removes the duplicate blobs.
+void DedupeSprites(std::vector<std::vector<uint8_t>> &sprites, std::vector<uint16_t> &sprite_idx)
+{
+	std::unordered_map<uint64_t, std::vector<uint16_t>> hash_map;
+	std::vector<std::vector<uint8_t>> unique_sprites;
+	sprite_idx.resize(sprites.size());
+	for(size_t i=0; i<sprites.size(); i++) {
+		uint64_t hash = convcache_key(sprites[i].data(), sprites[i].size(), {}).hash[0];
+		std::vector<uint16_t> &candidates = hash_map[hash];
+		bool found = false;
+		for(size_t j=0; j<candidates.size(); j++) {
+			if(unique_sprites[candidates[j]] == sprites[i]) {
+				sprite_idx[i] = candidates[j];
+				found = true;
+				break;
+			}
+		}
+		if(found) {
+			dedupe_sprites++;
+			dedupe_bytes += (sprites[i].size()+7) & ~7;
+			continue;
+		}
+		sprite_idx[i] = unique_sprites.size();
+		candidates.push_back(unique_sprites.size());
+		unique_sprites.push_back(std::move(sprites[i]));
+	}
+	sprites = std::move(unique_sprites);
+}
+
+// Makes writer match the machine the sheet is built for
+void SetupWriter(BinWriter *writer, const SheetOptions &options)
+{
+	if(options.host) {
+		uint16_t probe = 1;
+		writer->little_endian = *(uint8_t *)&probe == 1;
+		writer->ptr_size = sizeof(void *);
+	}
+}
+
+// Builds the record turning sprite prev into sprite cur: a span count followed
+// by spans of offset, size and the new bytes, each padded to 4 bytes. Returns
+// false if the sprites cannot be delta encoded.
+bool BuildDelta(const std::vector<uint8_t> &prev, const std::vector<uint8_t> &cur, std::vector<uint8_t> &record, const SheetOptions &options)
+{
+	if(prev.size() != cur.size()) {
+		return false;
+	}
+	BinWriter writer;
+	SetupWriter(&writer, options);
+	binwrite_symbol_ref(&writer, "num_spans");
+	int num_spans = 0;
+	size_t i = 0;
+	while(i < cur.size()) {
+		if(prev[i] == cur[i]) {
+			i++;
+			continue;
+		}
+		size_t start = i;
+		size_t last_diff = i;
+		while(i < cur.size() && i-last_diff <= DELTA_SPAN_GAP) {
+			if(prev[i] != cur[i]) {
+				last_diff = i;
+			}
+			i++;
+		}
+		binwrite_u32(&writer, start);
+		binwrite_u32(&writer, last_diff+1-start);
+		binwrite_data(&writer, &cur[start], last_diff+1-start);
+		binwrite_align(&writer, 4);
+		num_spans++;
+	}
+	binwrite_symbol_setval(&writer, num_spans, "num_spans");
+	record = std::move(writer.data);
+	return true;
+}
+
+// Picks keyframes and builds delta records for every frame of every animation.
+// Returns the number of delta encoded frames.
+size_t BuildDeltas(AnimSprData &data, const SheetOptions &options, std::vector<ImageRect> &rects,
+	std::vector<std::vector<uint8_t>> &sprites, std::vector<std::vector<std::vector<uint8_t>>> &deltas)
+{
+	size_t num_deltas = 0;
+	deltas.resize(data.anims.size());
+	for(size_t i=0; i<data.anims.size(); i++) {
+		std::vector<FrameData> &frames = data.anims[i].frames;
+		deltas[i].resize(frames.size());
+		for(size_t j=1; j<frames.size(); j++) {
+			if(j % options.delta_interval == 0) {
+				continue;
+			}
+			std::vector<uint8_t> &prev = sprites[rects[data.image_map[frames[j-1].image]].sprite_idx];
+			std::vector<uint8_t> &cur = sprites[rects[data.image_map[frames[j].image]].sprite_idx];
+			// The frame is read as a whole instead if that is smaller than the
+			// delta, compressed if the sheet is
+			size_t frame_size = cur.size();
+			if(options.compress) {
+				std::vector<uint8_t> compressed;
+				lz4_compress(cur.data(), cur.size(), compressed);
+				frame_size = std::min(frame_size, compressed.size());
+			}
+			if(!BuildDelta(prev, cur, deltas[i][j], options) || deltas[i][j].size() >= frame_size) {
+				deltas[i][j].clear();
+				continue;
+			}
+			num_deltas++;
+			delta_frames++;
+			delta_bytes_saved += frame_size-deltas[i][j].size();
+		}
+	}
+	return num_deltas;
+}
+
+// Sprites only shown through delta records are rebuilt from the frames before
+// them at runtime, so only their size is kept. raw_sizes receives the size
+// of every sprite.
+void DropDeltaSprites(AnimSprData &data, std::vector<ImageRect> &rects, std::vector<std::vector<std::vector<uint8_t>>> &deltas,
+	std::vector<std::vector<uint8_t>> &sprites, std::vector<uint32_t> &raw_sizes)
+{
+	std::vector<bool> needed(sprites.size(), false);
+	for(size_t i=0; i<data.anims.size(); i++) {
+		std::vector<FrameData> &frames = data.anims[i].frames;
+		for(size_t j=0; j<frames.size(); j++) {
+			if(deltas[i][j].empty()) {
+				needed[rects[data.image_map[frames[j].image]].sprite_idx] = true;
+			}
+		}
+	}
+	raw_sizes.resize(sprites.size());
+	for(size_t i=0; i<sprites.size(); i++) {
+		raw_sizes[i] = sprites[i].size();
+		if(!needed[i]) {
+			delta_sprites_dropped++;
+			delta_sprite_bytes_saved += (sprites[i].size()+7) & ~7;
+			sprites[i].clear();
+		}
+	}
+}
+
+// Compresses each sprite on its own so frames stay randomly accessible.
+// Sprites that do not shrink are kept raw. raw_sizes receives the size of
+// every sprite before compression.
+void CompressSprites(std::vector<std::vector<uint8_t>> &sprites, std::vector<uint32_t> &raw_sizes)
+{
+	raw_sizes.resize(sprites.size());
+	for(size_t i=0; i<sprites.size(); i++) {
+		if(sprites[i].empty()) {
+			// Dropped by DropDeltaSprites, which kept its size
+			continue;
+		}
+		std::vector<uint8_t> compressed;
+		std::vector<uint8_t> check;
+		raw_sizes[i] = sprites[i].size();
+		lz4_compress(sprites[i].data(), sprites[i].size(), compressed);
+		if(!lz4_decompress(compressed.data(), compressed.size(), check, sprites[i].size()) || check != sprites[i]) {
+			die("Internal error: LZ4 round trip failed for sprite %zu\n", i);
+		}
+		// Stored sizes are padded to 8 bytes, and the runtime tells compressed
+		// sprites apart by a padded size below that of the raw sprite
+		if(((compressed.size()+7) & ~7) >= ((sprites[i].size()+7) & ~7)) {
+			continue;
+		}
+		compressed_frames++;
+		compress_bytes_saved += sprites[i].size()-compressed.size();
+		sprites[i] = std::move(compressed);
+	}
+}
+
+// FNV-1a hash of an animation name. Must match HashAnimName in animsprite.c.
+uint32_t HashAnimName(const std::string &name)
+{
+	uint32_t hash = 2166136261u;
+	for(size_t i=0; i<name.size(); i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Builds an open addressing table of animation indices by name hash. Empty
+// entries are 0xFFFF. The table size is a power of two at least twice the
+// animation count so lookups end after a probe or two.
+void BuildAnimHash(AnimSprData &data, std::vector<uint16_t> &table)
+{
+	size_t size = 1;
+	while(size < data.anims.size()*2) {
+		size *= 2;
+	}
+	table.assign(size, 0xFFFF);
+	for(size_t i=0; i<data.anims.size(); i++) {
+		for(size_t j=0; j<i; j++) {
+			if(data.anims[j].name == data.anims[i].name) {
+				die("Duplicate animation name %s.\n", data.anims[i].name.c_str());
+			}
+		}
+		size_t slot = HashAnimName(data.anims[i].name) & (size-1);
+		while(table[slot] != 0xFFFF) {
+			slot = (slot+1) & (size-1);
+		}
+		table[slot] = i;
+	}
+}
+
+// Turns a name into a C identifier in upper case
+std::string MakeIdentifier(const std::string &name)
+{
+	std::string ident;
+	for(size_t i=0; i<name.size(); i++) {
+		ident += isalnum((unsigned char)name[i]) ? toupper((unsigned char)name[i]) : '_';
+	}
+	if(ident.empty() || isdigit((unsigned char)ident[0])) {
+		ident = "_" + ident;
+	}
+	return ident;
+}
+
+// Sprites of one animation of a chunked sheet, each stored once
+struct AnimChunk {
+	std::vector<uint16_t> sprites;
+	std::vector<uint32_t> frame_ofs; // Offset of the sprite of each frame in the chunk
+	uint32_t size = 0;
+};
+
+void BuildChunks(AnimSprData &data, std::vector<ImageRect> &rects, std::vector<std::vector<uint8_t>> &sprites, std::vector<AnimChunk> &chunks)
+{
+	chunks.resize(data.anims.size());
+	for(size_t i=0; i<data.anims.size(); i++) {
+		std::map<uint16_t, uint32_t> sprite_ofs;
+		AnimChunk &chunk = chunks[i];
+		for(size_t j=0; j<data.anims[i].frames.size(); j++) {
+			uint16_t sprite_idx = rects[data.image_map[data.anims[i].frames[j].image]].sprite_idx;
+			if(sprite_ofs.count(sprite_idx) == 0) {
+				sprite_ofs[sprite_idx] = chunk.size;
+				chunk.sprites.push_back(sprite_idx);
+				chunk.size += (sprites[sprite_idx].size()+7) & ~7;
+			}
+			chunk.frame_ofs.push_back(sprite_ofs[sprite_idx]);
+		}
 	}
-	binwrite_u32(file, 'ASPR');
+}
+
+// Writes a header with an enum of the animation indices for
+// AnimSpriteSetAnimIndex, named after the output file
+void WriteAnimHeader(const char *path, AnimSprData &data, const SheetOptions &options)
+{
+	std::string stem = fs::path(path).stem().string();
+	std::string prefix = MakeIdentifier(stem);
+	fs::path header_path = fs::path(options.header_dir) / (stem + "_anims.h");
+	std::string text;
+	text += "// Generated by mkanimspr from the animations of " + fs::path(path).filename().string() + "\n";
+	text += "#ifndef " + prefix + "_ANIMS_H\n";
+	text += "#define " + prefix + "_ANIMS_H\n\n";
+	text += "enum {\n";
+	for(size_t i=0; i<data.anims.size(); i++) {
+		text += "\t" + prefix + "_ANIM_" + MakeIdentifier(data.anims[i].name) + " = " + std::to_string(i) + ",\n";
+	}
+	text += "\t" + prefix + "_ANIM_COUNT = " + std::to_string(data.anims.size()) + "\n";
+	text += "};\n\n#endif\n";
+	BinWriter writer;
+	binwrite_data(&writer, text.data(), text.size());
+	// Leave an unchanged header alone so code including it is not rebuilt
+	if(fs::exists(header_path)) {
+		std::vector<uint8_t> old_text;
+		ReadFile(header_path.string().c_str(), old_text);
+		if(old_text == writer.data) {
+			return;
+		}
+	}
+	if(!binwrite_save(&writer, header_path.string().c_str())) {
+		die("Failed to write %s\n", header_path.string().c_str());
+	}
+}
+
+// Converts the images of a sheet to one sprite per source and adds the time
+// taken to the format totals of report
+void ConvertSheet(AnimSprData &data, const SheetOptions &options, size_t num_threads, std::vector<ImageRect> &rects,
+	std::vector<uint16_t> &palette, std::vector<std::vector<uint8_t>> &sprites, SheetReport &report)
+{
+	std::vector<SpriteSource> sources;
+	BuildSources(data, options, sources, rects);
+	palette.clear();
+	if(options.shared_palette) {
+		BuildSharedPalette(sources, palette);
+	}
+	std::vector<uint64_t> image_ns;
+	ConvertImages(sources, sprites, image_ns, num_threads);
+	for(size_t i=0; i<sources.size(); i++) {
+		report.formats[sources[i].format].convert_ns += image_ns[i];
+	}
+}
+
+void WriteAnimSpr(const char *path, AnimSprData &data, SheetOptions options, size_t num_threads, SheetReport &report)
+{
+	std::vector<ImageRect> rects;
+	std::vector<std::vector<uint8_t>> sprites;
+	std::vector<uint16_t> sprite_idx;
+	std::vector<uint16_t> palette;
+	std::vector<std::vector<std::vector<uint8_t>>> deltas;
+	std::vector<uint16_t> anim_hash;
+	std::vector<uint32_t> raw_sizes;
+	std::vector<AnimChunk> chunks;
+	if(options.shared_palette && external_mksprite_flag) {
+		die("Shared palettes are not supported with --external-mksprite\n");
+	}
+	if(options.delta_interval && (!options.stream || options.atlas)) {
+		die("Delta encoding requires --stream and cannot be combined with --atlas\n");
+	}
+	if(options.compress && !options.stream) {
+		die("Compression requires --stream\n");
+	}
+	if(options.chunked && options.stream) {
+		die("--chunked and --stream cannot be combined\n");
+	}
+	PhaseTimer timer(path);
+	BuildAnimHash(data, anim_hash);
+	ConvertSheet(data, options, num_threads, rects, palette, sprites, report);
+	if(options.delta_interval) {
+		// Records refer to sprites by image before duplicates are merged
+		if(BuildDeltas(data, options, rects, sprites, deltas) == 0) {
+			// Without a single delta the shared canvas only makes sprites
+			// larger, so the sheet is converted again without it
+			options.delta_interval = 0;
+			deltas.clear();
+			ConvertSheet(data, options, num_threads, rects, palette, sprites, report);
+		}
+	}
+	timer.Lap(report.convert_ns, "convert");
+	DedupeSprites(sprites, sprite_idx);
+	for(size_t i=0; i<rects.size(); i++) {
+		rects[i].sprite_idx = sprite_idx[rects[i].sprite_idx];
+		if(!options.atlas) {
+			// The image covers the whole sprite, read its size from the sprite_t header
+			std::vector<uint8_t> &sprite = sprites[rects[i].sprite_idx];
+			rects[i].width = (sprite[0] << 8) | sprite[1];
+			rects[i].height = (sprite[2] << 8) | sprite[3];
+		}
+	}
+	if(options.delta_interval) {
+		DropDeltaSprites(data, rects, deltas, sprites, raw_sizes);
+	}
+	if(options.compress) {
+		CompressSprites(sprites, raw_sizes);
+	}
+	if(options.chunked) {
+		BuildChunks(data, rects, sprites, chunks);
+	}
+	timer.Lap(report.pack_ns, "pack");
+	fs::path spr_data_path{path};
+	spr_data_path.replace_extension(spr_data_path.extension().string()+".dat");
+	BinWriter writer;
+	SetupWriter(&writer, options);
+	BinWriter *file = &writer;
+	BinWriter spr_data_writer;
+	SetupWriter(&spr_data_writer, options);
+	ByteCounter header_bytes(&writer);
+	ByteCounter spr_data_bytes(&spr_data_writer);
+	binwrite_u32(file, ASPR_MAGIC);
+	binwrite_u32(file, ASPR_VERSION);
 	binwrite_u32(file, data.anims.size());
-	binwrite_u32(file, data.images.size());
-	if(!stream_flag) {
-		binwrite_symbol_ref(file, "sprdata");
+	binwrite_u32(file, sprites.size());
+	binwrite_u32(file, rects.size());
+	binwrite_u32(file, palette.size());
+	if(options.delta_interval) {
+		binwrite_symbol_ref(file, "delta_maxsize");
 	} else {
 		binwrite_u32(file, 0);
 	}
+	binwrite_symbol_ref(file, "reloc_count");
+	binwrite_symbol_ref(file, "relocs");
+	binwrite_symbol_ref(file, "rdpdata");
+	if(!options.stream && !options.chunked) {
+		binwrite_ptr_ref(file, "sprdata");
+	} else {
+		binwrite_ptr_null(file);
+	}
+	if(options.stream) {
+		binwrite_ptr_ref(file, "streamdata");
+	} else {
+		binwrite_ptr_null(file);
+	}
+	if(options.chunked) {
+		binwrite_ptr_ref(file, "chunks");
+	} else {
+		binwrite_ptr_null(file);
+	}
+	binwrite_ptr_ref(file, "images");
+	if(!palette.empty()) {
+		binwrite_ptr_ref(file, "palette");
+	} else {
+		binwrite_ptr_null(file);
+	}
+	if(options.delta_interval) {
+		binwrite_ptr_ref(file, "deltas");
+	} else {
+		binwrite_ptr_null(file);
+	}
+	binwrite_u32(file, anim_hash.size()-1);
+	binwrite_ptr_ref(file, "animhash");
 	
 	for(size_t i=0; i<data.anims.size(); i++) {
 		std::string data_name = "animdata" + std::to_string(i);
-		binwrite_symbol_ref(file, data_name);
+		binwrite_ptr_ref(file, data_name);
 	}
+	header_bytes.Add(report.header_bytes);
 	for(size_t i=0; i<data.anims.size(); i++) {
 		std::string data_name = "animdata" + std::to_string(i);
 		std::string name = "animname" + std::to_string(i);
 		
+		binwrite_align(file, file->ptr_size);
 		binwrite_symbol_set(file, data_name);
-		binwrite_symbol_ref(file, name);
+		binwrite_ptr_ref(file, name);
 		binwrite_u16(file, data.anims[i].frames.size());
 		binwrite_u16(file, data.anims[i].total_time);
 		for(size_t j=0; j<data.anims[i].frames.size(); j++) {
@@ -244,47 +1132,273 @@ void WriteAnimSpr(const char *path, AnimSprData &data)
 			binwrite_u16(file, data.image_map[data.anims[i].frames[j].image]);
 		}
 	}
+	binwrite_symbol_set(file, "animhash");
+	for(size_t i=0; i<anim_hash.size(); i++) {
+		binwrite_u16(file, anim_hash[i]);
+	}
+	binwrite_align(file, 4);
+	binwrite_symbol_set(file, "images");
+	for(size_t i=0; i<rects.size(); i++) {
+		binwrite_u16(file, rects[i].sprite_idx);
+		binwrite_u16(file, rects[i].s);
+		binwrite_u16(file, rects[i].t);
+		binwrite_u16(file, rects[i].width);
+		binwrite_u16(file, rects[i].height);
+		binwrite_u16(file, rects[i].x_ofs);
+		binwrite_u16(file, rects[i].y_ofs);
+		binwrite_u16(file, 0);
+	}
+	if(options.delta_interval) {
+		binwrite_align(file, file->ptr_size);
+		binwrite_symbol_set(file, "deltas");
+		for(size_t i=0; i<data.anims.size(); i++) {
+			binwrite_ptr_ref(file, "deltaanim" + std::to_string(i));
+		}
+		for(size_t i=0; i<data.anims.size(); i++) {
+			binwrite_symbol_set(file, "deltaanim" + std::to_string(i));
+			for(size_t j=0; j<deltas[i].size(); j++) {
+				if(deltas[i][j].empty()) {
+					// Keyframe
+					binwrite_u32(file, 0);
+					binwrite_u32(file, 0);
+				} else {
+					// Offset in the sprite data file is filled in once that is laid out
+					binwrite_symbol_ref(file, "delta" + std::to_string(i) + "_" + std::to_string(j));
+					binwrite_u32(file, deltas[i][j].size());
+				}
+			}
+		}
+	}
+	header_bytes.Add(report.table_bytes);
 	for(size_t i=0; i<data.anims.size(); i++) {
 		std::string name = "animname" + std::to_string(i);
 		binwrite_symbol_set(file, name);
 		binwrite_string(file, data.anims[i].name.c_str());
 	}
+	header_bytes.Add(report.name_bytes);
 	size_t sprdat_maxsize = 0;
-	if(stream_flag) {
-		fclose(file);
-		file = fopen(spr_data_path.c_str(), "wb");
-		if(!file) {
-			die("Failed to open %s for writing\n", spr_data_path.c_str());
+	binwrite_align(file, 8);
+	if(options.chunked) {
+		binwrite_symbol_set(file, "chunks");
+		for(size_t i=0; i<chunks.size(); i++) {
+			binwrite_symbol_ref(file, "chunk" + std::to_string(i));
+			binwrite_u32(file, chunks[i].size);
+			binwrite_ptr_ref(file, "chunkframes" + std::to_string(i));
 		}
+		for(size_t i=0; i<chunks.size(); i++) {
+			binwrite_align(file, 4);
+			binwrite_symbol_set(file, "chunkframes" + std::to_string(i));
+			for(size_t j=0; j<chunks[i].frame_ofs.size(); j++) {
+				binwrite_u32(file, chunks[i].frame_ofs[j]);
+			}
+		}
+		file = &spr_data_writer;
 	} else {
-		binwrite_align(file, 8);
-		binwrite_symbol_set(file, "sprdata");
+		if(options.stream) {
+			// The offset table stays in the header so no read of the sprite data
+			// file is needed to find a frame
+			binwrite_symbol_set(file, "streamdata");
+			file = &spr_data_writer;
+		} else {
+			binwrite_symbol_set(file, "sprdata");
+		}
+		binwrite_symbol_ref(&writer, "sprdat_maxsize");
+		if(options.stream) {
+			binwrite_symbol_ref(&writer, "sprdat_compmaxsize");
+			if(!raw_sizes.empty()) {
+				binwrite_ptr_ref(&writer, "rawsizes");
+			} else {
+				binwrite_ptr_null(&writer);
+			}
+		}
+		// Sprites are pointers when embedded and file offsets when streamed
+		void (*sprite_ref)(BinWriter *, std::string) = options.stream ? binwrite_symbol_ref : binwrite_ptr_ref;
+		for(size_t i=0; i<sprites.size(); i++) {
+			std::string name = "sprite" + std::to_string(i);
+			sprite_ref(&writer, name);
+		}
+		sprite_ref(&writer, "sprdat_end");
 	}
-	
-	
-	binwrite_symbol_ref(file, "sprdat_maxsize");
-	for(size_t i=0; i<data.images.size(); i++) {
-		std::string name = "sprite" + std::to_string(i);
-		binwrite_symbol_ref(file, name);
+	if(!raw_sizes.empty()) {
+		binwrite_align(&writer, 4);
+		binwrite_symbol_set(&writer, "rawsizes");
+		for(size_t i=0; i<raw_sizes.size(); i++) {
+			binwrite_u32(&writer, raw_sizes[i]);
+		}
+	}
+	// Every pointer has been written, list them for LoadASPR
+	binwrite_align(&writer, 4);
+	binwrite_symbol_set(&writer, "relocs");
+	binwrite_symbol_setval(&writer, writer.relocs.size(), "reloc_count");
+	for(size_t i=0; i<writer.relocs.size(); i++) {
+		binwrite_u32(&writer, writer.relocs[i]);
 	}
-	binwrite_symbol_ref(file, "sprdat_end");
+	header_bytes.Add(report.table_bytes);
+	// Only what follows is read by the RDP, so only it is written back from
+	// the CPU cache on load. The palette is aligned for loading into TMEM.
+	binwrite_align(&writer, 8);
+	binwrite_symbol_set(&writer, "rdpdata");
+	if(!palette.empty()) {
+		binwrite_symbol_set(&writer, "palette");
+		for(size_t i=0; i<palette.size(); i++) {
+			binwrite_u16(&writer, palette[i]);
+		}
+	}
+	header_bytes.Add(report.palette_bytes);
+	ByteCounter &file_bytes = file == &spr_data_writer ? spr_data_bytes : header_bytes;
 	binwrite_align(file, 8);
-	for(size_t i=0; i<data.images.size(); i++) {
-		std::string name = "sprite" + std::to_string(i);
-		size_t data_start = ftell(file);
-		binwrite_symbol_set(file, name);
-		ConvertImage(file, &data.images[i]);
+	if(options.chunked) {
+		// Each chunk is read as a whole, so sprites shown by several
+		// animations are stored once per animation
+		for(size_t i=0; i<chunks.size(); i++) {
+			binwrite_symbol_setval(&writer, binwrite_get_pos(file), "chunk" + std::to_string(i));
+			for(size_t j=0; j<chunks[i].sprites.size(); j++) {
+				std::vector<uint8_t> &sprite = sprites[chunks[i].sprites[j]];
+				binwrite_data(file, sprite.data(), sprite.size());
+				binwrite_align(file, 8);
+			}
+		}
+	} else {
+		for(size_t i=0; i<sprites.size(); i++) {
+			std::string name = "sprite" + std::to_string(i);
+			size_t data_start = binwrite_get_pos(file);
+			binwrite_symbol_setval(&writer, data_start, name);
+			binwrite_data(file, sprites[i].data(), sprites[i].size());
+			binwrite_align(file, 8);
+			size_t data_end = binwrite_get_pos(file);
+			size_t data_size = data_end-data_start;
+			if(data_size > sprdat_maxsize) {
+				sprdat_maxsize = data_size;
+			}
+		}
 		binwrite_align(file, 8);
-		size_t data_end = ftell(file);
-		size_t data_size = data_end-data_start;
-		if(data_size > sprdat_maxsize) {
-			sprdat_maxsize = data_size;
+		binwrite_symbol_setval(&writer, binwrite_get_pos(file), "sprdat_end");
+	}
+	file_bytes.Add(report.sprite_bytes);
+	if(!raw_sizes.empty()) {
+		// Buffers hold whole sprites. Compressed ones are read into a staging
+		// buffer first and dropped ones are rebuilt from delta records.
+		binwrite_symbol_setval(&writer, options.compress ? sprdat_maxsize : 0, "sprdat_compmaxsize");
+		sprdat_maxsize = 0;
+		for(size_t i=0; i<raw_sizes.size(); i++) {
+			sprdat_maxsize = std::max<size_t>(sprdat_maxsize, (raw_sizes[i]+7) & ~7);
 		}
+	} else if(options.stream) {
+		binwrite_symbol_setval(&writer, 0, "sprdat_compmaxsize");
 	}
-	binwrite_align(file, 8);
-	binwrite_symbol_set(file, "sprdat_end");
-	binwrite_symbol_setval(file, sprdat_maxsize, "sprdat_maxsize");
-	fclose(file);
+	if(!options.chunked) {
+		binwrite_symbol_setval(&writer, sprdat_maxsize, "sprdat_maxsize");
+	}
+	if(options.delta_interval) {
+		size_t delta_maxsize = 0;
+		// Animations stepping between the same two sprites share a record
+		std::map<std::vector<uint8_t>, size_t> record_ofs;
+		for(size_t i=0; i<deltas.size(); i++) {
+			for(size_t j=0; j<deltas[i].size(); j++) {
+				if(deltas[i][j].empty()) {
+					continue;
+				}
+				std::string name = "delta" + std::to_string(i) + "_" + std::to_string(j);
+				auto found = record_ofs.find(deltas[i][j]);
+				if(found != record_ofs.end()) {
+					binwrite_symbol_setval(&writer, found->second, name);
+					continue;
+				}
+				record_ofs[deltas[i][j]] = binwrite_get_pos(file);
+				binwrite_symbol_setval(&writer, binwrite_get_pos(file), name);
+				binwrite_data(file, deltas[i][j].data(), deltas[i][j].size());
+				binwrite_align(file, 8);
+				delta_maxsize = std::max(delta_maxsize, deltas[i][j].size());
+			}
+		}
+		file_bytes.Add(report.delta_bytes);
+		binwrite_symbol_setval(&writer, delta_maxsize, "delta_maxsize");
+	}
+	report.padding_bytes = writer.padding+spr_data_writer.padding;
+	report.patched_refs = writer.patched_refs+spr_data_writer.patched_refs;
+	timer.Lap(report.layout_ns, "layout");
+	if(!binwrite_save(&writer, path)) {
+		die("Failed to write %s\n", path);
+	}
+	if(file == &spr_data_writer && !binwrite_save(file, spr_data_path.string().c_str())) {
+		die("Failed to write %s\n", spr_data_path.string().c_str());
+	}
+	if(!options.header_dir.empty()) {
+		WriteAnimHeader(path, data, options);
+	}
+	timer.Lap(report.write_ns, "write");
+	for(size_t i=0; i<data.anims.size(); i++) {
+		report.num_frames += data.anims[i].frames.size();
+	}
+	report.num_images = rects.size();
+	for(size_t i=0; i<data.images.size(); i++) {
+		report.formats[data.images[i].format].num_images++;
+	}
+	report.num_sprites = sprites.size();
+	report.output_size = writer.data.size();
+	report.output_size += spr_data_writer.data.size();
+}
+
+#define NUM_SLOWEST_IMAGES 10
+
+static double ToMs(uint64_t ns)
+{
+	return ns/1000000.0;
+}
+
+void PrintStats(const std::vector<SheetJob> &jobs, uint64_t total_ns)
+{
+	SheetReport total;
+	for(size_t i=0; i<jobs.size(); i++) {
+		const SheetReport &report = jobs[i].report;
+		total.xml_ns += report.xml_ns;
+		total.convert_ns += report.convert_ns;
+		total.pack_ns += report.pack_ns;
+		total.layout_ns += report.layout_ns;
+		total.write_ns += report.write_ns;
+		total.num_frames += report.num_frames;
+		total.num_images += report.num_images;
+		total.num_sprites += report.num_sprites;
+		total.output_size += report.output_size;
+		total.header_bytes += report.header_bytes;
+		total.table_bytes += report.table_bytes;
+		total.name_bytes += report.name_bytes;
+		total.palette_bytes += report.palette_bytes;
+		total.sprite_bytes += report.sprite_bytes;
+		total.delta_bytes += report.delta_bytes;
+		total.padding_bytes += report.padding_bytes;
+		total.patched_refs += report.patched_refs;
+	}
+	fprintf(stderr, "Sheets: %zu (%zu frames, %zu images, %zu sprites) in %.2f ms\n", jobs.size(),
+		total.num_frames, total.num_images, total.num_sprites, ToMs(total_ns));
+	// Sheets converted in parallel overlap, so these can add up to more than the total
+	fprintf(stderr, "Time per step: xml %.2f ms, convert %.2f ms, pack %.2f ms, layout %.2f ms, write %.2f ms\n",
+		ToMs(total.xml_ns), ToMs(total.convert_ns), ToMs(total.pack_ns), ToMs(total.layout_ns), ToMs(total.write_ns));
+	fprintf(stderr, "Output: %zu bytes\n", total.output_size);
+	fprintf(stderr, "  Header: %zu bytes\n", total.header_bytes);
+	fprintf(stderr, "  Animation, image and sprite tables: %zu bytes\n", total.table_bytes);
+	fprintf(stderr, "  Names: %zu bytes\n", total.name_bytes);
+	fprintf(stderr, "  Palettes: %zu bytes\n", total.palette_bytes);
+	fprintf(stderr, "  Sprite data: %zu bytes\n", total.sprite_bytes);
+	fprintf(stderr, "  Delta records: %zu bytes\n", total.delta_bytes);
+	fprintf(stderr, "  Padding: %zu bytes\n", total.padding_bytes);
+	fprintf(stderr, "Symbol references patched: %zu\n", total.patched_refs);
+	std::vector<std::pair<uint64_t, std::string>> slowest = image_times;
+	size_t num_slowest = std::min<size_t>(slowest.size(), NUM_SLOWEST_IMAGES);
+	std::partial_sort(slowest.begin(), slowest.begin()+num_slowest, slowest.end(), std::greater<>());
+	if(num_slowest != 0) {
+		fprintf(stderr, "Slowest images:\n");
+	}
+	for(size_t i=0; i<num_slowest; i++) {
+		fprintf(stderr, "  %8.2f ms %s\n", ToMs(slowest[i].first), slowest[i].second.c_str());
+	}
+	if(convcache_enabled()) {
+		fprintf(stderr, "Conversion cache: %u hits, %u misses\n", convcache_hits(), convcache_misses());
+	}
+	fprintf(stderr, "Duplicate sprites merged: %u (%zu bytes saved)\n", dedupe_sprites.load(), dedupe_bytes.load());
+	fprintf(stderr, "Delta encoded frames: %u (%zu bytes saved per pass)\n", delta_frames.load(), delta_bytes_saved.load());
+	fprintf(stderr, "Sprites only shown through deltas: %u (%zu bytes saved)\n", delta_sprites_dropped.load(), delta_sprite_bytes_saved.load());
+	fprintf(stderr, "Compressed sprites: %u (%zu bytes saved)\n", compressed_frames.load(), compress_bytes_saved.load());
 }
 
 static char* path_remove_trailing_slash(char *path)
@@ -316,14 +1430,237 @@ const char *n64_tools_dir(void)
     return n64_inst;
 }
 
+// Parses a flag that can differ between input files. Returns the number of
+// arguments used or 0 if argv[i] is not such a flag.
+int ParseSheetFlag(SheetOptions &options, int argc, const char **argv, int i)
+{
+	if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stream")) {
+		options.stream = true;
+		return 1;
+	}
+	if (!strcmp(argv[i], "--trim")) {
+		options.trim = true;
+		return 1;
+	}
+	if (!strcmp(argv[i], "--shared-palette")) {
+		options.shared_palette = true;
+		return 1;
+	}
+	if (!strcmp(argv[i], "--compress")) {
+		options.compress = true;
+		return 1;
+	}
+	if (!strcmp(argv[i], "--chunked")) {
+		options.chunked = true;
+		return 1;
+	}
+	if (!strcmp(argv[i], "--delta")) {
+		if (i+1 == argc) {
+			die("Missing argument for %s\n", argv[i]);
+		}
+		options.delta_interval = atoi(argv[i+1]);
+		if (options.delta_interval <= 0) {
+			die("Invalid keyframe interval %s\n", argv[i+1]);
+		}
+		return 2;
+	}
+	if (!strcmp(argv[i], "--host")) {
+		options.host = true;
+		return 1;
+	}
+	if (!strcmp(argv[i], "--header-dir")) {
+		if (i+1 == argc) {
+			die("Missing argument for %s\n", argv[i]);
+		}
+		options.header_dir = argv[i+1];
+		return 2;
+	}
+	if (!strcmp(argv[i], "--atlas")) {
+		options.atlas = true;
+		return 1;
+	}
+	if (!strcmp(argv[i], "--atlas-size")) {
+		if (i+1 == argc) {
+			die("Missing argument for %s\n", argv[i]);
+		}
+		if (sscanf(argv[i+1], "%dx%d", &options.atlas_width, &options.atlas_height) != 2
+			|| options.atlas_width <= 0 || options.atlas_height <= 0) {
+			die("Invalid atlas size %s\n", argv[i+1]);
+		}
+		return 2;
+	}
+	return 0;
+}
+
+void ReadManifest(const char *path, std::vector<SheetJob> &jobs, const SheetOptions &defaults)
+{
+	std::vector<uint8_t> data;
+	ReadFile(path, data);
+	std::string text(data.begin(), data.end());
+	size_t line_start = 0;
+	int line_num = 0;
+	while(line_start < text.size()) {
+		size_t line_end = text.find('\n', line_start);
+		if(line_end == std::string::npos) {
+			line_end = text.size();
+		}
+		std::string line = text.substr(line_start, line_end-line_start);
+		line_start = line_end+1;
+		line_num++;
+		size_t comment = line.find('#');
+		if(comment != std::string::npos) {
+			line.resize(comment);
+		}
+		std::vector<std::string> tokens;
+		size_t pos = 0;
+		while((pos = line.find_first_not_of(" \t\r", pos)) != std::string::npos) {
+			size_t end = line.find_first_of(" \t\r", pos);
+			if(end == std::string::npos) {
+				end = line.size();
+			}
+			tokens.push_back(line.substr(pos, end-pos));
+			pos = end;
+		}
+		if(tokens.empty()) {
+			continue;
+		}
+		std::vector<const char *> args;
+		for(size_t i=0; i<tokens.size(); i++) {
+			args.push_back(tokens[i].c_str());
+		}
+		SheetJob job;
+		job.options = defaults;
+		std::vector<std::string> files;
+		for(int i=0; i<(int)args.size(); i++) {
+			if(args[i][0] == '-') {
+				int used = ParseSheetFlag(job.options, args.size(), args.data(), i);
+				if(used == 0) {
+					die("%s:%d: invalid flag: %s\n", path, line_num, args[i]);
+				}
+				i += used-1;
+			} else {
+				files.push_back(args[i]);
+			}
+		}
+		if(files.size() != 2) {
+			die("%s:%d: expected an input and an output filename\n", path, line_num);
+		}
+		job.input = files[0];
+		job.output = files[1];
+		jobs.push_back(job);
+	}
+}
+
+void RunJob(SheetJob &job, size_t num_threads)
+{
+	AnimSprData animspr;
+	PhaseTimer timer(job.input);
+	ReadXML(job.input.c_str(), animspr);
+	timer.Lap(job.report.xml_ns, "xml");
+	WriteAnimSpr(job.output.c_str(), animspr, job.options, num_threads, job.report);
+}
+
+void RunJobs(std::vector<SheetJob> &jobs)
+{
+	size_t num_workers = std::min<size_t>(num_jobs, jobs.size());
+	if(num_workers <= 1) {
+		for(size_t i=0; i<jobs.size(); i++) {
+			RunJob(jobs[i], num_jobs);
+		}
+		return;
+	}
+	// Split the job count between files and the images within each file
+	size_t num_threads = std::max<size_t>(1, num_jobs/num_workers);
+	std::atomic<size_t> next_job{0};
+	std::vector<std::thread> workers;
+	for(size_t i=0; i<num_workers; i++) {
+		workers.emplace_back([&]() {
+			size_t job;
+			while((job = next_job++) < jobs.size()) {
+				RunJob(jobs[job], num_threads);
+			}
+		});
+	}
+	for(size_t i=0; i<workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+// Writes how long each sheet took to convert as JSON so runs can be compared
+// between builds
+void WriteTimings(const char *path, const std::vector<SheetJob> &jobs, uint64_t total_ns)
+{
+	std::string text = "{\n";
+	text += "\t\"aspr_version\": " + std::to_string(ASPR_VERSION) + ",\n";
+	text += "\t\"jobs\": " + std::to_string(num_jobs) + ",\n";
+	text += "\t\"total_ns\": " + std::to_string(total_ns) + ",\n";
+	text += "\t\"sheets\": [";
+	for(size_t i=0; i<jobs.size(); i++) {
+		const SheetReport &report = jobs[i].report;
+		text += i == 0 ? "\n" : ",\n";
+		text += "\t\t{\n";
+		text += "\t\t\t\"input\": " + trace_json_string(jobs[i].input) + ",\n";
+		text += "\t\t\t\"output\": " + trace_json_string(jobs[i].output) + ",\n";
+		text += "\t\t\t\"frames\": " + std::to_string(report.num_frames) + ",\n";
+		text += "\t\t\t\"images\": " + std::to_string(report.num_images) + ",\n";
+		text += "\t\t\t\"sprites\": " + std::to_string(report.num_sprites) + ",\n";
+		text += "\t\t\t\"output_bytes\": " + std::to_string(report.output_size) + ",\n";
+		text += "\t\t\t\"xml_ns\": " + std::to_string(report.xml_ns) + ",\n";
+		text += "\t\t\t\"convert_ns\": " + std::to_string(report.convert_ns) + ",\n";
+		text += "\t\t\t\"pack_ns\": " + std::to_string(report.pack_ns) + ",\n";
+		text += "\t\t\t\"layout_ns\": " + std::to_string(report.layout_ns) + ",\n";
+		text += "\t\t\t\"write_ns\": " + std::to_string(report.write_ns) + ",\n";
+		// Sheets mixing formats are compared between builds format by format
+		text += "\t\t\t\"formats\": {";
+		for(auto it=report.formats.begin(); it!=report.formats.end(); ++it) {
+			text += it == report.formats.begin() ? "\n" : ",\n";
+			text += "\t\t\t\t" + trace_json_string(it->first) + ": { \"images\": " + std::to_string(it->second.num_images);
+			text += ", \"convert_ns\": " + std::to_string(it->second.convert_ns) + " }";
+		}
+		text += "\n\t\t\t}\n";
+		text += "\t\t}";
+	}
+	text += "\n\t]\n}\n";
+	BinWriter writer;
+	binwrite_data(&writer, text.data(), text.size());
+	if(!binwrite_save(&writer, path)) {
+		die("Failed to write %s\n", path);
+	}
+}
+
 void print_args(char *name)
 {
     fprintf(stderr, "%s -- Animated sprite builder tool\n\n", name);
     fprintf(stderr, "This tool can be used to compress/decompress arbitrary asset files in a format\n");
-    fprintf(stderr, "Usage: %s [flags] <input files...>\n", name);
+    fprintf(stderr, "Usage: %s [flags] <input> <output> [[flags] <input> <output>...]\n", name);
     fprintf(stderr, "\n");
     fprintf(stderr, "Command-line flags:\n");
-    fprintf(stderr, "   -e/--embed				Embed sprites into output\n");
+    fprintf(stderr, "   -s/--stream				Write sprites to a separate .dat file for streaming\n");
+    fprintf(stderr, "   --trim				Crop frames to their visible pixels and store draw offsets\n");
+    fprintf(stderr, "   --shared-palette		Quantize all CI4/CI8 frames of a sheet to one palette\n");
+    fprintf(stderr, "				stored in the header instead of one palette per frame\n");
+    fprintf(stderr, "   --delta <n>			Stream frames as changes to the previous frame with a\n");
+    fprintf(stderr, "				keyframe at least every <n> frames (requires --stream)\n");
+    fprintf(stderr, "   --compress			LZ4 compress each streamed sprite on its own (requires --stream)\n");
+    fprintf(stderr, "   --chunked			Store the sprites of each animation together in a .dat file\n");
+    fprintf(stderr, "				and load them when the animation is first shown\n");
+    fprintf(stderr, "   --atlas				Pack the frames of a sheet into shared texture pages\n");
+    fprintf(stderr, "   --atlas-size <w>x<h>		Maximum size of an atlas page (default: 256x256)\n");
+    fprintf(stderr, "   --header-dir <dir>		Write <dir>/<output name>_anims.h with an enum of the\n");
+    fprintf(stderr, "				animation indices for AnimSpriteSetAnimIndex\n");
+    fprintf(stderr, "   --host				Use the byte order and pointer size of this machine so the\n");
+    fprintf(stderr, "				runtime can load the sheet in a host build\n");
+    fprintf(stderr, "   -j/--jobs <n>			Convert up to <n> files or images in parallel (default: 1, 0: one per CPU)\n");
+    fprintf(stderr, "   -m/--manifest <file>		Read input/output pairs from <file>, one per line\n");
+    fprintf(stderr, "				optionally followed by flags for that pair\n");
+    fprintf(stderr, "   --external-mksprite		Convert images by running $N64_INST/bin/mksprite\n");
+    fprintf(stderr, "   --compare-mksprite		Check the built-in encoder against mksprite for every image\n");
+    fprintf(stderr, "   --cache <dir>			Reuse converted images stored in <dir>\n");
+    fprintf(stderr, "   --stats				Print conversion statistics, the slowest images and what\n");
+    fprintf(stderr, "				the output bytes hold\n");
+    fprintf(stderr, "   --trace <file>			Write the time spent in each step and image to <file> as\n");
+    fprintf(stderr, "				Chrome trace events\n");
+    fprintf(stderr, "   --timings <file>		Write the time spent in each step and format of every sheet to <file> as JSON\n");
     fprintf(stderr, "\n");
 }
 
@@ -333,38 +1670,90 @@ int main(int argc, char **argv)
 		print_args(argv[0]);
 		return 1;
 	}
-	// Find n64 tool directory
-	if (!n64_inst) {
-		n64_inst = n64_tools_dir();
-		if (!n64_inst) {
-			die("Error: N64_INST environment variable not set\n");
-			return 1;
-		}
-	}
+	std::vector<SheetJob> jobs;
+	SheetOptions options;
 	for (int i = 1; i < argc; i++) {
 		if (argv[i][0] == '-') {
-			if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			int used = ParseSheetFlag(options, argc, (const char **)argv, i);
+			if (used != 0) {
+				i += used-1;
+			} else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
                 print_args(argv[0]);
                 return 0;
-            } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stream")) {
-                stream_flag = true;
+            } else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+				if (++i == argc) {
+					die("Missing argument for %s\n", argv[i-1]);
+				}
+				num_jobs = atoi(argv[i]);
+				if (num_jobs <= 0) {
+					num_jobs = std::thread::hardware_concurrency();
+					if (num_jobs <= 0) {
+						num_jobs = 1;
+					}
+				}
+            } else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--manifest")) {
+				if (++i == argc) {
+					die("Missing argument for %s\n", argv[i-1]);
+				}
+				ReadManifest(argv[i], jobs, options);
+            } else if (!strcmp(argv[i], "--external-mksprite")) {
+				external_mksprite_flag = true;
+            } else if (!strcmp(argv[i], "--compare-mksprite")) {
+				compare_mksprite_flag = true;
+            } else if (!strcmp(argv[i], "--cache")) {
+				if (++i == argc) {
+					die("Missing argument for %s\n", argv[i-1]);
+				}
+				convcache_init(argv[i]);
+            } else if (!strcmp(argv[i], "--stats")) {
+				stats_flag = true;
+            } else if (!strcmp(argv[i], "--trace")) {
+				if (++i == argc) {
+					die("Missing argument for %s\n", argv[i-1]);
+				}
+				trace_path = argv[i];
+				trace_init();
+            } else if (!strcmp(argv[i], "--timings")) {
+				if (++i == argc) {
+					die("Missing argument for %s\n", argv[i-1]);
+				}
+				timings_path = argv[i];
             } else {
 				die("invalid flag: %s\n", argv[i]);
                 return 1;
 			}
 			continue;
 		}
-		AnimSprData animspr;
-		const char *infn = argv[i];
-		const char *outfn;
+		SheetJob job;
+		job.input = argv[i];
 		if (++i == argc) {
 			die("Missing output filename argument\n");
 			return 1;
 		}
-		outfn = argv[i];
-		ReadXML(infn, animspr);
-		WriteAnimSpr(outfn, animspr);
+		job.output = argv[i];
+		job.options = options;
+		jobs.push_back(job);
+	}
+	// Find n64 tool directory
+	if ((external_mksprite_flag || compare_mksprite_flag) && !n64_inst) {
+		n64_inst = n64_tools_dir();
+		if (!n64_inst) {
+			die("Error: N64_INST environment variable not set\n");
+			return 1;
+		}
+	}
+	PhaseTimer timer;
+	uint64_t total_ns = 0;
+	RunJobs(jobs);
+	timer.Lap(total_ns, "total");
+	if (stats_flag) {
+		PrintStats(jobs, total_ns);
+	}
+	if (trace_path && !trace_save(trace_path)) {
+		die("Failed to write %s\n", trace_path);
+	}
+	if (timings_path) {
+		WriteTimings(timings_path, jobs, total_ns);
 	}
-	
 	return 0;
-}
\ No newline at end of file
+}
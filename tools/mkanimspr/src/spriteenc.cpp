@@ -0,0 +1,654 @@
+#include <png.h>
+
+#include <algorithm>
+#include <map>
+#include <string.h>
+
+#include "spriteenc.h"
+
+// Texture formats as encoded in tex_format_t
+enum {
+	FMT_RGBA16 = 2,
+	FMT_RGBA32 = 3,
+	FMT_CI4 = 8,
+	FMT_CI8 = 9,
+	FMT_IA4 = 12,
+	FMT_IA8 = 13,
+	FMT_IA16 = 14,
+	FMT_I4 = 16,
+	FMT_I8 = 17
+};
+
+// sprite_t flags
+#define SPRITE_FLAGS_EXT 0x80
+
+// Layout of sprite_ext_t written after the pixel data
+#define SPRITE_EXT_VERSION 4
+#define SPRITE_EXT_SIZE 124
+#define SPRITE_MAX_LODS 7
+
+enum DitherAlgo {
+	DITHER_NONE,
+	DITHER_RANDOM,
+	DITHER_ORDERED
+};
+
+struct FormatInfo {
+	const char *name;
+	int fmt;
+	int bpp;
+};
+
+static const FormatInfo formats[] = {
+	{ "RGBA16", FMT_RGBA16, 16 },
+	{ "RGBA32", FMT_RGBA32, 32 },
+	{ "CI4", FMT_CI4, 4 },
+	{ "CI8", FMT_CI8, 8 },
+	{ "IA4", FMT_IA4, 4 },
+	{ "IA8", FMT_IA8, 8 },
+	{ "IA16", FMT_IA16, 16 },
+	{ "I4", FMT_I4, 4 },
+	{ "I8", FMT_I8, 8 },
+};
+
+static const uint8_t bayer4x4[4][4] = {
+	{ 0, 8, 2, 10 },
+	{ 12, 4, 14, 6 },
+	{ 3, 11, 1, 9 },
+	{ 15, 7, 13, 5 }
+};
+
+static void w8(std::vector<uint8_t> &out, uint8_t value)
+{
+	out.push_back(value);
+}
+
+static void w16(std::vector<uint8_t> &out, uint16_t value)
+{
+	w8(out, value >> 8);
+	w8(out, value & 0xff);
+}
+
+static void w32(std::vector<uint8_t> &out, uint32_t value)
+{
+	w16(out, value >> 16);
+	w16(out, value & 0xffff);
+}
+
+static void w32_at(std::vector<uint8_t> &out, size_t pos, uint32_t value)
+{
+	out[pos] = value >> 24;
+	out[pos+1] = (value >> 16) & 0xff;
+	out[pos+2] = (value >> 8) & 0xff;
+	out[pos+3] = value & 0xff;
+}
+
+static void walign(std::vector<uint8_t> &out, size_t align)
+{
+	while(out.size() % align) {
+		w8(out, 0);
+	}
+}
+
+static void wpad(std::vector<uint8_t> &out, size_t size)
+{
+	out.insert(out.end(), size, 0);
+}
+
+static const FormatInfo *FindFormat(const char *name)
+{
+	for(size_t i=0; i<sizeof(formats)/sizeof(formats[0]); i++) {
+		if(!strcmp(formats[i].name, name)) {
+			return &formats[i];
+		}
+	}
+	return NULL;
+}
+
+static uint8_t Intensity(const uint8_t *px)
+{
+	return (px[0]*299 + px[1]*587 + px[2]*114 + 500) / 1000;
+}
+
+// Returns a channel value offset by the dither threshold for reducing it to bits bits
+static uint8_t Dither(uint8_t value, int bits, int x, int y, DitherAlgo algo, uint32_t &seed)
+{
+	if(bits >= 8 || algo == DITHER_NONE) {
+		return value;
+	}
+	int step = 256 >> bits;
+	int threshold;
+	if(algo == DITHER_ORDERED) {
+		threshold = bayer4x4[y & 3][x & 3];
+	} else {
+		seed = seed*1103515245+12345;
+		threshold = (seed >> 16) & 0xf;
+	}
+	int result = value + ((threshold*step) >> 4) - (step >> 1);
+	return std::clamp(result, 0, 255);
+}
+
+static uint16_t ToRGBA16(const uint8_t *px)
+{
+	return ((px[0] >> 3) << 11) | ((px[1] >> 3) << 6) | ((px[2] >> 3) << 1) | (px[3] >> 7);
+}
+
+struct ColorBox {
+	std::vector<std::pair<uint16_t, uint32_t>> colors;
+
+	int Channel(uint16_t color, int channel) const
+	{
+		switch(channel) {
+			case 0:
+				return (color >> 11) & 0x1F;
+
+			case 1:
+				return (color >> 6) & 0x1F;
+
+			case 2:
+				return (color >> 1) & 0x1F;
+
+			default:
+				return (color & 0x1)*31;
+		}
+	}
+
+	int Range(int channel) const
+	{
+		int min = 31, max = 0;
+		for(auto &color : colors) {
+			int value = Channel(color.first, channel);
+			min = std::min(min, value);
+			max = std::max(max, value);
+		}
+		return max-min;
+	}
+
+	uint16_t Average() const
+	{
+		uint64_t sum[4] = {};
+		uint64_t total = 0;
+		for(auto &color : colors) {
+			for(int i=0; i<4; i++) {
+				sum[i] += (uint64_t)Channel(color.first, i)*color.second;
+			}
+			total += color.second;
+		}
+		uint16_t r = (sum[0]+total/2)/total;
+		uint16_t g = (sum[1]+total/2)/total;
+		uint16_t b = (sum[2]+total/2)/total;
+		uint16_t a = (sum[3]+total/2)/total >= 16;
+		return (r << 11) | (g << 6) | (b << 1) | a;
+	}
+};
+
+static int ColorDistance(uint16_t a, uint16_t b)
+{
+	ColorBox box;
+	int dist = 0;
+	for(int i=0; i<4; i++) {
+		int delta = box.Channel(a, i)-box.Channel(b, i);
+		dist += delta*delta;
+	}
+	return dist;
+}
+
+static void GetPixels16(const SpriteImage &image, std::vector<uint16_t> &pixels)
+{
+	size_t base = pixels.size();
+	pixels.resize(base+image.width*image.height);
+	for(size_t i=0; i<(size_t)image.width*image.height; i++) {
+		const uint8_t *px = &image.pixels[i*4];
+		// Fully transparent pixels all share one palette entry
+		pixels[base+i] = (px[3] == 0) ? 0 : ToRGBA16(px);
+	}
+}
+
+// Builds a palette of at most max_colors RGBA16 entries with median cut
+static void BuildPalette(const std::vector<uint16_t> &pixels, int max_colors, std::vector<uint16_t> &palette)
+{
+	std::map<uint16_t, uint32_t> histogram;
+	std::vector<uint16_t> first_seen;
+	for(size_t i=0; i<pixels.size(); i++) {
+		if(histogram[pixels[i]]++ == 0) {
+			first_seen.push_back(pixels[i]);
+		}
+	}
+	palette.clear();
+	if((int)first_seen.size() <= max_colors) {
+		palette = first_seen;
+		return;
+	}
+	std::vector<ColorBox> boxes(1);
+	for(auto &color : histogram) {
+		boxes[0].colors.push_back(color);
+	}
+	while((int)boxes.size() < max_colors) {
+		int best_box = -1, best_channel = 0, best_range = 0;
+		for(size_t i=0; i<boxes.size(); i++) {
+			if(boxes[i].colors.size() < 2) {
+				continue;
+			}
+			for(int j=0; j<4; j++) {
+				int range = boxes[i].Range(j);
+				if(range > best_range) {
+					best_box = i;
+					best_channel = j;
+					best_range = range;
+				}
+			}
+		}
+		if(best_box == -1) {
+			break;
+		}
+		ColorBox &box = boxes[best_box];
+		std::sort(box.colors.begin(), box.colors.end(), [&](auto &a, auto &b) {
+			return box.Channel(a.first, best_channel) < box.Channel(b.first, best_channel);
+		});
+		uint64_t total = 0;
+		for(auto &color : box.colors) {
+			total += color.second;
+		}
+		size_t split = 0;
+		uint64_t count = 0;
+		while(split < box.colors.size()-1 && count+box.colors[split].second <= total/2) {
+			count += box.colors[split++].second;
+		}
+		if(split == 0) {
+			split = 1;
+		}
+		ColorBox new_box;
+		new_box.colors.assign(box.colors.begin()+split, box.colors.end());
+		box.colors.resize(split);
+		boxes.push_back(new_box);
+	}
+	for(auto &box : boxes) {
+		palette.push_back(box.Average());
+	}
+}
+
+static void MapPalette(const std::vector<uint16_t> &pixels, const std::vector<uint16_t> &palette, std::vector<uint8_t> &indices)
+{
+	std::map<uint16_t, uint8_t> lookup;
+	indices.resize(pixels.size());
+	for(size_t i=0; i<pixels.size(); i++) {
+		auto iter = lookup.find(pixels[i]);
+		if(iter == lookup.end()) {
+			int best = 0, best_dist = INT32_MAX;
+			for(size_t j=0; j<palette.size(); j++) {
+				int dist = ColorDistance(pixels[i], palette[j]);
+				if(dist < best_dist) {
+					best = j;
+					best_dist = dist;
+				}
+			}
+			iter = lookup.emplace(pixels[i], best).first;
+		}
+		indices[i] = iter->second;
+	}
+}
+
+// Uses the palette of a paletted PNG as is, like mksprite does. Fails if the
+// image has no palette, too many colors or pixels that no longer match it.
+static bool SourcePalette(const SpriteImage &image, int max_colors, std::vector<uint16_t> &palette, std::vector<uint8_t> &indices)
+{
+	size_t num_colors = image.colormap.size()/4;
+	size_t num_pixels = (size_t)image.width*image.height;
+	if(num_colors == 0 || num_colors > (size_t)max_colors || image.indices.size() != num_pixels) {
+		return false;
+	}
+	for(size_t i=0; i<num_pixels; i++) {
+		if(image.indices[i] >= num_colors || memcmp(&image.colormap[image.indices[i]*4], &image.pixels[i*4], 4)) {
+			return false;
+		}
+	}
+	palette.clear();
+	for(size_t i=0; i<num_colors; i++) {
+		palette.push_back(ToRGBA16(&image.colormap[i*4]));
+	}
+	indices = image.indices;
+	return true;
+}
+
+static const char *AutoFormat(const SpriteImage &image)
+{
+	if(image.paletted && !image.colormap.empty()) {
+		return image.colormap.size()/4 <= 16 ? "CI4" : "CI8";
+	}
+	if(image.paletted) {
+		std::vector<uint16_t> pixels;
+		std::vector<uint16_t> palette;
+		GetPixels16(image, pixels);
+		BuildPalette(pixels, 256, palette);
+		return palette.size() <= 16 ? "CI4" : "CI8";
+	}
+	if(!image.color) {
+		return image.alpha ? "IA16" : "I8";
+	}
+	return "RGBA16";
+}
+
+bool spriteenc_load_png(SpriteImage &image, const void *png_data, size_t png_size, std::string &error)
+{
+	png_image png;
+	memset(&png, 0, sizeof(png));
+	png.version = PNG_IMAGE_VERSION;
+	if(!png_image_begin_read_from_memory(&png, png_data, png_size)) {
+		error = png.message;
+		return false;
+	}
+	image.width = png.width;
+	image.height = png.height;
+	image.paletted = (png.format & PNG_FORMAT_FLAG_COLORMAP) != 0;
+	image.color = (png.format & PNG_FORMAT_FLAG_COLOR) != 0;
+	image.alpha = (png.format & PNG_FORMAT_FLAG_ALPHA) != 0;
+	image.colormap.clear();
+	image.indices.clear();
+	if(!image.paletted) {
+		png.format = PNG_FORMAT_RGBA;
+		image.pixels.resize(PNG_IMAGE_SIZE(png));
+		if(!png_image_finish_read(&png, NULL, image.pixels.data(), 0, NULL)) {
+			error = png.message;
+			png_image_free(&png);
+			return false;
+		}
+		return true;
+	}
+	// Keep the palette and indices so CI formats can use them in PNG order
+	png.format = PNG_FORMAT_RGBA_COLORMAP;
+	image.indices.resize(PNG_IMAGE_SIZE(png));
+	image.colormap.resize(PNG_IMAGE_COLORMAP_SIZE(png));
+	if(!png_image_finish_read(&png, NULL, image.indices.data(), 0, image.colormap.data())) {
+		error = png.message;
+		png_image_free(&png);
+		return false;
+	}
+	image.colormap.resize(png.colormap_entries*4);
+	image.pixels.resize(image.indices.size()*4);
+	for(size_t i=0; i<image.indices.size(); i++) {
+		memcpy(&image.pixels[i*4], &image.colormap[image.indices[i]*4], 4);
+	}
+	return true;
+}
+
+bool spriteenc_load_png_file(SpriteImage &image, const char *path, std::string &error)
+{
+	FILE *file = fopen(path, "rb");
+	if(!file) {
+		error = "Failed to open file";
+		return false;
+	}
+	std::vector<uint8_t> data;
+	while (1) {
+		uint8_t buf[65536];
+		size_t n = fread(buf, 1, sizeof(buf), file);
+		if (n == 0) break;
+		data.insert(data.end(), buf, buf+n);
+	}
+	fclose(file);
+	return spriteenc_load_png(image, data.data(), data.size(), error);
+}
+
+bool spriteenc_save_png(std::vector<uint8_t> &out, const SpriteImage &image, std::string &error)
+{
+	png_image png;
+	memset(&png, 0, sizeof(png));
+	png.version = PNG_IMAGE_VERSION;
+	png.width = image.width;
+	png.height = image.height;
+	png.format = PNG_FORMAT_RGBA;
+	png_alloc_size_t size = 0;
+	if(!png_image_write_to_memory(&png, NULL, &size, 0, image.pixels.data(), 0, NULL)) {
+		error = png.message;
+		return false;
+	}
+	out.resize(size);
+	if(!png_image_write_to_memory(&png, out.data(), &size, 0, image.pixels.data(), 0, NULL)) {
+		error = png.message;
+		return false;
+	}
+	out.resize(size);
+	return true;
+}
+
+void spriteenc_quantize(const std::vector<const SpriteImage *> &images, int max_colors, std::vector<uint16_t> &palette)
+{
+	std::vector<uint16_t> pixels;
+	for(size_t i=0; i<images.size(); i++) {
+		GetPixels16(*images[i], pixels);
+	}
+	BuildPalette(pixels, max_colors, palette);
+}
+
+bool spriteenc_encode(std::vector<uint8_t> &out, const SpriteImage &image, const char *format, const char *dither_algo, std::string &error,
+	const std::vector<uint16_t> *shared_palette)
+{
+	if(!strcmp(format, "AUTO")) {
+		format = AutoFormat(image);
+	}
+	const FormatInfo *info = FindFormat(format);
+	if(!info) {
+		error = std::string("Unsupported format ") + format;
+		return false;
+	}
+	DitherAlgo dither;
+	if(!strcmp(dither_algo, "NONE")) {
+		dither = DITHER_NONE;
+	} else if(!strcmp(dither_algo, "RANDOM")) {
+		dither = DITHER_RANDOM;
+	} else if(!strcmp(dither_algo, "ORDERED")) {
+		dither = DITHER_ORDERED;
+	} else {
+		error = std::string("Unsupported dither algorithm ") + dither_algo;
+		return false;
+	}
+	if(image.width <= 0 || image.height <= 0 || image.width > 65535 || image.height > 65535) {
+		error = "Invalid image size";
+		return false;
+	}
+	std::vector<uint16_t> palette;
+	std::vector<uint8_t> indices;
+	if(info->fmt == FMT_CI4 || info->fmt == FMT_CI8) {
+		std::vector<uint16_t> pixels;
+		GetPixels16(image, pixels);
+		if(shared_palette) {
+			if(shared_palette->size() > (1U << info->bpp)) {
+				error = "Shared palette has too many colors for " + std::string(info->name);
+				return false;
+			}
+			MapPalette(pixels, *shared_palette, indices);
+		} else if(!SourcePalette(image, 1 << info->bpp, palette, indices)) {
+			BuildPalette(pixels, 1 << info->bpp, palette);
+			MapPalette(pixels, palette, indices);
+		}
+	}
+
+	// sprite_t header
+	size_t base = out.size();
+	w16(out, image.width);
+	w16(out, image.height);
+	w8(out, info->bpp / 8); // Legacy bitdepth field
+	w8(out, info->fmt | SPRITE_FLAGS_EXT);
+	w8(out, 1); // hslices
+	w8(out, 1); // vslices
+
+	// Pixel data, rows are packed without padding
+	uint32_t seed = 0;
+	for(int y=0; y<image.height; y++) {
+		uint8_t nibble = 0;
+		for(int x=0; x<image.width; x++) {
+			const uint8_t *px = &image.pixels[(y*image.width+x)*4];
+			uint8_t r = Dither(px[0], info->fmt == FMT_RGBA16 ? 5 : 8, x, y, dither, seed);
+			uint8_t g = Dither(px[1], info->fmt == FMT_RGBA16 ? 5 : 8, x, y, dither, seed);
+			uint8_t b = Dither(px[2], info->fmt == FMT_RGBA16 ? 5 : 8, x, y, dither, seed);
+			uint8_t value4 = 0;
+			switch(info->fmt) {
+				case FMT_RGBA16:
+				{
+					uint8_t dithered[4] = { r, g, b, px[3] };
+					w16(out, ToRGBA16(dithered));
+				}
+					break;
+
+				case FMT_RGBA32:
+					w8(out, r);
+					w8(out, g);
+					w8(out, b);
+					w8(out, px[3]);
+					break;
+
+				case FMT_CI8:
+					w8(out, indices[y*image.width+x]);
+					break;
+
+				case FMT_CI4:
+					value4 = indices[y*image.width+x];
+					break;
+
+				case FMT_IA16:
+					w8(out, Intensity(px));
+					w8(out, px[3]);
+					break;
+
+				case FMT_IA8:
+					w8(out, (Dither(Intensity(px), 4, x, y, dither, seed) & 0xF0) | (Dither(px[3], 4, x, y, dither, seed) >> 4));
+					break;
+
+				case FMT_IA4:
+					value4 = ((Dither(Intensity(px), 3, x, y, dither, seed) >> 5) << 1) | (px[3] >> 7);
+					break;
+
+				case FMT_I8:
+					w8(out, Intensity(px));
+					break;
+
+				case FMT_I4:
+					value4 = Dither(Intensity(px), 4, x, y, dither, seed) >> 4;
+					break;
+			}
+			if(info->bpp == 4) {
+				if(x & 1) {
+					w8(out, nibble | value4);
+				} else {
+					nibble = value4 << 4;
+				}
+			}
+		}
+		if(info->bpp == 4 && (image.width & 1)) {
+			w8(out, nibble);
+		}
+	}
+
+	// sprite_ext_t
+	walign(out, 8);
+	size_t ext_start = out.size();
+	w16(out, SPRITE_EXT_SIZE);
+	w16(out, SPRITE_EXT_VERSION);
+	size_t pal_pos = out.size();
+	w32(out, 0); // Palette position
+	wpad(out, SPRITE_MAX_LODS*8); // No LODs
+	w16(out, 0); // Flags
+	w16(out, 0); // Padding
+	wpad(out, SPRITE_EXT_SIZE-(out.size()-ext_start)); // Default texparms and no detail texture
+
+	// Palette
+	if(!palette.empty()) {
+		walign(out, 8);
+		w32_at(out, pal_pos, out.size()-base);
+		for(size_t i=0; i<(1U << info->bpp); i++) {
+			w16(out, i < palette.size() ? palette[i] : 0);
+		}
+	}
+	walign(out, 8);
+	return true;
+}
+
+static uint32_t r32(const std::vector<uint8_t> &data, size_t pos)
+{
+	return (data[pos] << 24) | (data[pos+1] << 16) | (data[pos+2] << 8) | data[pos+3];
+}
+
+// Where the parts of an encoded sprite are
+struct SpriteLayout {
+	const FormatInfo *info;
+	int width;
+	int height;
+	size_t pixels_size;
+	size_t pal_pos;
+};
+
+static bool ParseLayout(const std::vector<uint8_t> &data, SpriteLayout &layout)
+{
+	if(data.size() < 8) {
+		return false;
+	}
+	layout.info = NULL;
+	for(size_t i=0; i<sizeof(formats)/sizeof(formats[0]); i++) {
+		if(formats[i].fmt == (data[5] & 0x1F)) {
+			layout.info = &formats[i];
+		}
+	}
+	layout.width = (data[0] << 8) | data[1];
+	layout.height = (data[2] << 8) | data[3];
+	layout.pixels_size = (size_t)layout.height*((layout.width*(layout.info ? layout.info->bpp : 0)+7)/8);
+	size_t ext_pos = (8+layout.pixels_size+7) & ~7;
+	if(!layout.info || ext_pos+SPRITE_EXT_SIZE > data.size()) {
+		return false;
+	}
+	layout.pal_pos = r32(data, ext_pos+4);
+	return layout.pal_pos+(2U << layout.info->bpp) <= data.size();
+}
+
+// Returns the RGBA16 color of a texel of a paletted sprite. Texels without
+// alpha all compare equal whatever their color.
+static uint16_t TexelColor(const std::vector<uint8_t> &data, const SpriteLayout &layout, int x, int y)
+{
+	size_t row = 8+(size_t)y*((layout.width*layout.info->bpp+7)/8);
+	uint8_t index = data[row+x*layout.info->bpp/8];
+	if(layout.info->bpp == 4) {
+		index = (x & 1) ? (index & 0xF) : (index >> 4);
+	}
+	uint16_t color = (data[layout.pal_pos+index*2] << 8) | data[layout.pal_pos+index*2+1];
+	return (color & 1) ? color : 0;
+}
+
+bool spriteenc_compare(const SpriteImage &image, const std::vector<uint8_t> &out, const std::vector<uint8_t> &reference, std::string &error)
+{
+	if(out == reference) {
+		return true;
+	}
+	size_t ofs = 0;
+	while(ofs < out.size() && ofs < reference.size() && out[ofs] == reference[ofs]) {
+		ofs++;
+	}
+	error = "differs at offset " + std::to_string(ofs) + " (sizes " + std::to_string(out.size()) + " and " + std::to_string(reference.size()) + ")";
+	SpriteLayout layout;
+	std::vector<uint16_t> palette;
+	std::vector<uint8_t> indices;
+	if(out.size() != reference.size() || !ParseLayout(out, layout)) {
+		return false;
+	}
+	bool paletted = layout.info->fmt == FMT_CI4 || layout.info->fmt == FMT_CI8;
+	if(!paletted || SourcePalette(image, 1 << layout.info->bpp, palette, indices)) {
+		return false;
+	}
+	// Only the palette and the indices may differ
+	size_t pal_end = layout.pal_pos+(2U << layout.info->bpp);
+	for(size_t i=0; i<out.size(); i++) {
+		bool texel = i >= 8 && i < 8+layout.pixels_size;
+		bool color = i >= layout.pal_pos && i < pal_end;
+		if(!texel && !color && out[i] != reference[i]) {
+			error = "differs at offset " + std::to_string(i);
+			return false;
+		}
+	}
+	for(int y=0; y<layout.height; y++) {
+		for(int x=0; x<layout.width; x++) {
+			if(TexelColor(out, layout, x, y) != TexelColor(reference, layout, x, y)) {
+				error = "texel " + std::to_string(x) + "," + std::to_string(y) + " has a different color";
+				return false;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,34 @@
+#ifndef SPRITEENC_H
+#define SPRITEENC_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Bumped whenever the bytes produced by spriteenc_encode change
+#define SPRITEENC_VERSION 2
+
+struct SpriteImage {
+	int width = 0;
+	int height = 0;
+	bool paletted = false; // Source PNG was paletted
+	bool color = false; // Source PNG had color channels
+	bool alpha = false; // Source PNG had an alpha channel or tRNS
+	std::vector<uint8_t> pixels; // RGBA8, row-major
+	std::vector<uint8_t> colormap; // RGBA8 palette of paletted PNGs
+	std::vector<uint8_t> indices; // Palette index of each pixel of paletted PNGs
+};
+
+bool spriteenc_load_png(SpriteImage &image, const void *png_data, size_t png_size, std::string &error);
+bool spriteenc_load_png_file(SpriteImage &image, const char *path, std::string &error);
+bool spriteenc_save_png(std::vector<uint8_t> &out, const SpriteImage &image, std::string &error);
+void spriteenc_quantize(const std::vector<const SpriteImage *> &images, int max_colors, std::vector<uint16_t> &palette);
+// Paletted formats use shared_palette instead of embedding their own if it is not NULL
+bool spriteenc_encode(std::vector<uint8_t> &out, const SpriteImage &image, const char *format, const char *dither_algo, std::string &error,
+	const std::vector<uint16_t> *shared_palette = NULL);
+// Compares a sprite encoded from image with one written by mksprite. Paletted
+// sprites quantized from true color images are compared by the color of each
+// texel, since the palette order depends on the quantizer.
+bool spriteenc_compare(const SpriteImage &image, const std::vector<uint8_t> &out, const std::vector<uint8_t> &reference, std::string &error);
+
+#endif
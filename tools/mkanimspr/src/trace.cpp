@@ -0,0 +1,124 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "trace.h"
+#include "binwrite.h"
+
+struct TraceEvent {
+	const char *category;
+	std::string name;
+	std::string detail;
+	uint64_t start_ns;
+	uint64_t dur_ns;
+	int thread;
+};
+
+static const auto start_time = std::chrono::steady_clock::now();
+static bool tracing = false;
+static std::mutex event_mutex;
+static std::vector<TraceEvent> events;
+static std::atomic<int> next_thread{0};
+
+// Small thread numbers read better in trace viewers than native IDs
+static int GetThreadNum(void)
+{
+	thread_local int thread = next_thread++;
+	return thread;
+}
+
+void trace_init(void)
+{
+	tracing = true;
+}
+
+bool trace_enabled(void)
+{
+	return tracing;
+}
+
+uint64_t trace_now(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start_time).count();
+}
+
+void trace_event(const char *category, const std::string &name, uint64_t start_ns, uint64_t end_ns, const std::string &detail)
+{
+	if(!tracing) {
+		return;
+	}
+	TraceEvent event = { category, name, detail, start_ns, end_ns-start_ns, GetThreadNum() };
+	std::lock_guard<std::mutex> lock(event_mutex);
+	events.push_back(std::move(event));
+}
+
+std::string trace_json_string(const std::string &text)
+{
+	std::string out = "\"";
+	for(size_t i=0; i<text.size(); i++) {
+		char c = text[i];
+		if(c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if((unsigned char)c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+bool trace_save(const char *path)
+{
+	std::lock_guard<std::mutex> lock(event_mutex);
+	std::string text = "{\"traceEvents\":[\n";
+	text += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"mkanimspr\"}}";
+	for(size_t i=0; i<events.size(); i++) {
+		const TraceEvent &event = events[i];
+		char times[64];
+		// Timestamps are in microseconds
+		snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f", event.start_ns/1000.0, event.dur_ns/1000.0);
+		text += ",\n{\"name\":" + trace_json_string(event.name) + ",\"cat\":\"" + event.category + "\",\"ph\":\"X\",";
+		text += std::string(times) + ",\"pid\":1,\"tid\":" + std::to_string(event.thread);
+		if(!event.detail.empty()) {
+			text += ",\"args\":{\"detail\":" + trace_json_string(event.detail) + "}";
+		}
+		text += "}";
+	}
+	text += "\n],\"displayTimeUnit\":\"ms\"}\n";
+	BinWriter writer;
+	binwrite_data(&writer, text.data(), text.size());
+	return binwrite_save(&writer, path);
+}
+
+TraceScope::TraceScope(const char *category, std::string name, std::string detail)
+	: category(category), name(std::move(name)), detail(std::move(detail)), start(trace_now())
+{
+}
+
+TraceScope::~TraceScope()
+{
+	trace_event(category, name, start, trace_now(), detail);
+}
+
+uint64_t TraceScope::Elapsed() const
+{
+	return trace_now()-start;
+}
+
+PhaseTimer::PhaseTimer(std::string detail)
+	: detail(std::move(detail)), start(trace_now())
+{
+}
+
+void PhaseTimer::Lap(uint64_t &total, const char *name)
+{
+	uint64_t now = trace_now();
+	total += now-start;
+	trace_event("phase", name, start, now, detail);
+	start = now;
+}
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <string>
+
+// Timed events in the Chrome trace event format, viewable in chrome://tracing
+// or Perfetto. Events are only kept once trace_init has been called.
+void trace_init(void);
+bool trace_enabled(void);
+// Nanoseconds since the program started
+uint64_t trace_now(void);
+void trace_event(const char *category, const std::string &name, uint64_t start_ns, uint64_t end_ns, const std::string &detail = "");
+bool trace_save(const char *path);
+std::string trace_json_string(const std::string &text);
+
+// Records the time from construction to destruction as one event
+class TraceScope {
+public:
+	TraceScope(const char *category, std::string name, std::string detail = "");
+	~TraceScope();
+	uint64_t Elapsed() const;
+
+private:
+	const char *category;
+	std::string name;
+	std::string detail;
+	uint64_t start;
+};
+
+// Measures consecutive steps of a conversion and records each as an event
+class PhaseTimer {
+public:
+	PhaseTimer(std::string detail = "");
+	// Adds the time since the previous lap to total
+	void Lap(uint64_t &total, const char *name);
+
+private:
+	std::string detail;
+	uint64_t start;
+};
+
+#endif